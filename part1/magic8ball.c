@@ -6,19 +6,60 @@
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
 #include <linux/prandom.h>
+#include <linux/slab.h>
+#include <linux/ctype.h>
+#include <linux/string.h>
+#include <linux/siphash.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/overflow.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/uio.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/cred.h>
+#include <linux/user_namespace.h>
 
 MODULE_LICENSE("GPL");
 
+#define MAX_QUESTION 256
+
+static unsigned int cache_size = 1024;
+module_param(cache_size, uint, 0444);
+MODULE_PARM_DESC(cache_size, "Maximum number of questions kept in the answer cache (0 disables the cache)");
+
+static ulong question_seed;
+module_param(question_seed, ulong, 0444);
+MODULE_PARM_DESC(question_seed, "Key for the question hash, keeps answers stable across reloads (0 picks a random key)");
+
+static DEFINE_PER_CPU(unsigned long, cache_hits); //per CPU so a cache hit never writes a shared cache line
+static DEFINE_PER_CPU(unsigned long, cache_misses);
+
+static int cache_counter_get(char *buffer, const struct kernel_param *kp);
+static const struct kernel_param_ops cache_counter_ops = {
+    .get = cache_counter_get,
+};
+module_param_cb(cache_hits, &cache_counter_ops, &cache_hits, 0400); //root only, watching the counters tells whether a question was asked recently
+MODULE_PARM_DESC(cache_hits, "Number of questions answered from the cache");
+module_param_cb(cache_misses, &cache_counter_ops, &cache_misses, 0400);
+MODULE_PARM_DESC(cache_misses, "Number of questions not found in the cache");
+
 static int device_open(struct inode *inode, struct file *file);
 static int device_close(struct inode *inode, struct file *file);
-static ssize_t device_read(struct file *file, char __user *buff, size_t len, loff_t *offset);
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to);
 static ssize_t device_write(struct file *file, const char __user *buff, size_t len, loff_t *offset);
+static size_t normalize_question(char question[], size_t len); //This function lowercases a question in place, collapses runs of whitespace and strips trailing punctuation so that trivially different spellings of a question hash the same. It returns the normalized length.
+static unsigned int lookup_answer(struct user_namespace *ns, const char question[], size_t len); //This function returns the answer index for a normalized question. Answers of recent questions are kept in a bounded cache so that a repeated question skips the keyed hash. Cache entries belong to the user namespace that asked, a question is only found again from the same namespace. Cache hits only take the RCU read lock, the oldest question that was not asked again since it was last passed over is evicted when the cache is full. It returns unsigned int.
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = device_open,
     .release = device_close,
-    .read = device_read,
+    .read_iter = device_read_iter,
+    .splice_read = generic_file_splice_read, //lets cat, splice() and sendfile() move answers into pipes and sockets without a user space bounce buffer
     .write = device_write
 };
 
@@ -26,7 +67,7 @@ static struct miscdevice magic8ball = {
     .name = "magic8ball",
     .minor = MISC_DYNAMIC_MINOR,
     .fops = &fops,
-    .mode = 0444
+    .mode = 0666
 };
 
 static const char *strings[] = {
@@ -52,46 +93,264 @@ static const char *strings[] = {
     "Very doubtful.\n"
 };
 
+struct answer_entry {
+    struct rhash_head node;
+    struct list_head lru;
+    struct rcu_head rcu;
+    bool referenced; //asked again since eviction last passed over it, set without cache_lock
+    struct user_namespace *ns; //namespace of the asker, holds a reference
+    unsigned int answer;
+    u16 len;
+    char question[]; //normalized question, not NUL terminated
+};
+
+struct question_ref { //lookup key for the answer cache
+    struct user_namespace *ns;
+    const char *text;
+    size_t len;
+};
+
+struct asker {
+    int pending; //answer index for the last question written on this file, -1 if no question is pending
+};
+
+static u32 question_hashfn(const void *data, u32 len, u32 seed){
+    const struct question_ref *ref = data;
+    return jhash(ref->text, ref->len, seed ^ hash_ptr(ref->ns, 32));
+}
+
+static u32 answer_hashfn(const void *data, u32 len, u32 seed){
+    const struct answer_entry *entry = data;
+    return jhash(entry->question, entry->len, seed ^ hash_ptr(entry->ns, 32));
+}
+
+static int answer_cmpfn(struct rhashtable_compare_arg *arg, const void *obj){ //returns 0 when the entry holds the question
+    const struct question_ref *ref = arg->key;
+    const struct answer_entry *entry = obj;
+    return (entry->ns != ref->ns) || (entry->len != ref->len) || memcmp(entry->question, ref->text, ref->len);
+}
+
+static const struct rhashtable_params cache_params = {
+    .head_offset = offsetof(struct answer_entry, node),
+    .hashfn = question_hashfn,
+    .obj_hashfn = answer_hashfn,
+    .obj_cmpfn = answer_cmpfn,
+    .automatic_shrinking = true
+};
+
+static siphash_key_t question_key;
+static struct rhashtable answer_cache;
+static LIST_HEAD(answer_lru); //oldest question first, referenced entries are moved back to the tail when eviction reaches them
+static unsigned int cache_count;
+static DEFINE_SPINLOCK(cache_lock); //serializes inserts and evictions, lookups run under rcu_read_lock()
+
+static int cache_counter_get(char *buffer, const struct kernel_param *kp){
+    unsigned long __percpu *counter = kp->arg;
+    unsigned long total = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu){
+        total += *per_cpu_ptr(counter, cpu);
+    }
+    return sprintf(buffer, "%lu\n", total);
+}
+
 static int device_open(struct inode *inode, struct file *file) {
+    struct asker *asker = kmalloc(sizeof(*asker), GFP_KERNEL);
+
+    if (!asker){
+        return -ENOMEM;
+    }
+    asker->pending = -1;
+    file->private_data = asker;
+
     printk(KERN_INFO "Magic8Ball device opened\n");
     return 0;
 }
 
 static int device_close(struct inode *inode, struct file *file) {
+    kfree(file->private_data);
     printk(KERN_INFO "Magic8Ball device closed\n");
     return 0;
 }
 
-static ssize_t device_read(struct file *file, char __user *buff, size_t len, loff_t *offset){
-    unsigned int rand_num = prandom_u32(); //generate random number
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct asker *asker = iocb->ki_filp->private_data;
+    unsigned int rand_num;
+    int pending;
     size_t str_len;
     
-    if(*offset > 0){
+    if(iocb->ki_pos > 0){
     	return 0; //EOF
     }
     
-    rand_num %= ARRAY_SIZE(strings); //truncate random number to bounds of array
+    pending = xchg(&asker->pending, -1); //answer the pending question once, fall back to a random answer otherwise
+    if (pending >= 0){
+        rand_num = pending;
+    }
+    else{
+        rand_num = prandom_u32(); //generate random number
+        rand_num %= ARRAY_SIZE(strings); //truncate random number to bounds of array
+    }
 
     str_len = strlen(strings[rand_num]); //get length of chosen random string
-    if((str_len) > len){ //make sure to not write more than length of provided buffer
-        str_len = len;
+    if((str_len) > iov_iter_count(to)){ //make sure to not write more than length of provided buffer
+        str_len = iov_iter_count(to);
     }
 
-    if(copy_to_user(buff, strings[rand_num], str_len)){ //copy string to user space buffer, check for error
+    if(copy_to_iter(strings[rand_num], str_len, to) != str_len){ //copy string straight from the static table into the user buffer or pipe pages, check for error
         return -EFAULT;
     }
 
-    *offset += str_len;
+    iocb->ki_pos += str_len;
     return str_len;
 }
 
 static ssize_t device_write(struct file *file, const char __user *buff, size_t len, loff_t *offset){
-    return -EPERM;
+    struct asker *asker = file->private_data;
+    char question[MAX_QUESTION];
+    size_t question_len;
+
+    if (len > sizeof(question)){
+        return -EINVAL;
+    }
+
+    if (copy_from_user(question, buff, len)){
+        return -EFAULT;
+    }
+
+    question_len = normalize_question(question, len);
+    if (question_len == 0){
+        return -EINVAL;
+    }
+
+    asker->pending = lookup_answer(file->f_cred->user_ns, question, question_len); //the opener's namespace, like any other credential check on a file
+    *offset = 0; //rewind so the next read on this file returns the answer
+    return len;
+}
+
+static size_t normalize_question(char question[], size_t len){
+    size_t i, out = 0;
+    bool space = false;
+
+    for (i = 0; i < len; i++){
+        if (isspace(question[i])){
+            space = (out > 0); //drop leading whitespace, collapse the rest into a single space
+            continue;
+        }
+        if (space){
+            question[out++] = ' ';
+            space = false;
+        }
+        question[out++] = tolower(question[i]);
+    }
+
+    while ((out > 0) && strchr("?!. ", question[out - 1])){ //"Will it rain ?" and "will it rain" are the same question
+        out--;
+    }
+
+    return out;
+}
+
+static void evict_answers(void){ //called with cache_lock held
+    struct answer_entry *old;
+    unsigned int passed = 0;
+
+    while (cache_count > cache_size){
+        old = list_first_entry(&answer_lru, struct answer_entry, lru);
+        if (READ_ONCE(old->referenced) && (passed++ < cache_count)){ //second chance, but never loop for ever against busy readers
+            WRITE_ONCE(old->referenced, false);
+            list_move_tail(&old->lru, &answer_lru);
+            continue;
+        }
+        rhashtable_remove_fast(&answer_cache, &old->node, cache_params);
+        list_del(&old->lru);
+        cache_count--;
+        put_user_ns(old->ns); //lookups only compare the pointer, it may go away before the grace period ends
+        kfree_rcu(old, rcu); //a lookup may still be reading it
+    }
+}
+
+static unsigned int lookup_answer(struct user_namespace *ns, const char question[], size_t len){
+    struct question_ref ref = { ns, question, len };
+    struct answer_entry *entry;
+    unsigned int answer;
+
+    rcu_read_lock();
+    entry = rhashtable_lookup(&answer_cache, &ref, cache_params);
+    if (entry){
+        answer = entry->answer;
+        if (!READ_ONCE(entry->referenced)){ //only dirty the entry once per eviction pass
+            WRITE_ONCE(entry->referenced, true);
+        }
+    }
+    rcu_read_unlock();
+
+    if (entry){
+        this_cpu_inc(cache_hits);
+        return answer;
+    }
+    this_cpu_inc(cache_misses);
+
+    answer = siphash(question, len, &question_key) % ARRAY_SIZE(strings); //derive the answer from the keyed hash of the question
+
+    if (cache_size == 0){
+        return answer;
+    }
+
+    entry = kmalloc(struct_size(entry, question, len), GFP_KERNEL); //allocate outside of the lock, a failed allocation only costs the caching
+    if (!entry){
+        return answer;
+    }
+    entry->referenced = false;
+    entry->ns = get_user_ns(ns);
+    entry->answer = answer;
+    entry->len = len;
+    memcpy(entry->question, question, len);
+
+    spin_lock(&cache_lock);
+    if (rhashtable_lookup_insert_key(&answer_cache, &ref, &entry->node, cache_params) == 0){
+        list_add_tail(&entry->lru, &answer_lru);
+        cache_count++;
+        entry = NULL;
+        evict_answers();
+    }
+    spin_unlock(&cache_lock);
+
+    if (entry){ //another writer cached the same question first
+        put_user_ns(entry->ns);
+        kfree(entry);
+    }
+    return answer;
+}
+
+static void free_answer(void *ptr, void *arg){
+    struct answer_entry *entry = ptr;
+
+    put_user_ns(entry->ns);
+    kfree(entry);
 }
 
 static int __init magic8ball_init(void) {
-    int ret = misc_register(&magic8ball);
+    int ret;
+
+    if (question_seed){
+        question_key.key[0] = question_seed;
+        question_key.key[1] = ~(u64)question_seed;
+    }
+    else{
+        get_random_bytes(&question_key, sizeof(question_key));
+    }
+
+    ret = rhashtable_init(&answer_cache, &cache_params);
+    if (ret < 0){
+        printk(KERN_ERR "Magic8Ball module failed to load\n");
+        return ret;
+    }
+
+    ret = misc_register(&magic8ball);
     if (ret < 0){
+        rhashtable_destroy(&answer_cache);
         printk(KERN_ERR "Magic8Ball module failed to load\n");
         return ret;
     }
@@ -101,6 +360,8 @@ static int __init magic8ball_init(void) {
 
 static void __exit magic8ball_exit(void) {
     misc_deregister(&magic8ball);
+    rhashtable_free_and_destroy(&answer_cache, free_answer, NULL);
+    rcu_barrier(); //wait for evicted entries still queued for kfree_rcu
     printk(KERN_ALERT "Magic8Ball module unloaded\n");
 }
 
@@ -7,26 +7,65 @@
 #include <linux/fs.h>
 #include <linux/prandom.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/hashtable.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/ctype.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <net/genetlink.h>
+
+#include "blackjack.h"
 
 MODULE_LICENSE("GPL");
 
+struct game_data;
+struct blackjack_table;
+struct blackjack_session;
+
 static int device_open(struct inode *inode, struct file *file);
 static int device_close(struct inode *inode, struct file *file);
 static ssize_t device_read(struct file *file, char __user *buff, size_t len, loff_t *offset);
 static ssize_t device_write(struct file *file, const char __user *buff, size_t len, loff_t *offset);
-static void shuffle(void); //This function shuffles the array of integers 0 - 51 which correspond to a unique card in a card deck. It uses a psedo random number generator to mix up the cards. It returns void.
-static void reset(void); //This function resets the game to its initial state. The game state and all game values are reset and the cards are reset to an ordered state. This function returns void
-static void write_msg(char msg[]); //This function writes messages and information to a buffer to be printed in user space based on the actions of the player in the game. It returns void
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static enum bj_command parse_command(const char command[]); //This function matches the text written by the player against the known commands. It returns the command, BJ_CMD_INVALID for unknown input.
+static void play_command(struct blackjack_table *table, enum bj_command command, u32 seed); //This function runs one player command against a table and writes the dealer's responses to the table's message buffer. The seed is only used by SHUFFLE. If the table is recording, the command is appended to the recording. The table is locked for the whole command. It returns void.
+static void record_command(struct blackjack_table *table, enum bj_command command, u32 seed); //This function appends a command and its shuffle seed to the table's recording, timestamped relative to the previous command. It returns void.
+static long replay(struct bj_replay __user *arg); //This function re-executes a recording on a scratch table as fast as possible and reports the time it took and the final game state. It returns 0 or a negative error code.
+static void publish_event(struct blackjack_table *table, u8 type, u8 detail); //This function queues a table event for the netlink multicast group. Events are only queued while someone listens and are sent in batches by flush_events(). It returns void.
+static void flush_events(struct work_struct *work); //This function sends the queued table events to the netlink multicast group, one message per CPU batch. It returns void.
+static bool hand_finished(int before, int after); //This function checks if a command that moved the game from state before to state after finished a hand. It returns bool.
+static struct blackjack_session *get_session(bool create); //This function finds the table of the calling process's session, creating it if create is set. The session is marked busy until put_session() so it cannot be reaped in between. It returns the session or an ERR_PTR.
+static void put_session(struct blackjack_session *session); //This function releases a session returned by get_session() and restarts its idle time. It returns void.
+static void reap_sessions(struct work_struct *work); //This function frees the sessions that have been idle longer than session_timeout_secs and queues itself again while a timeout is set. It returns void.
+static void shuffle(struct blackjack_table *table, u32 seed); //This function shuffles the array of integers 0 - 51 which correspond to a unique card in a card deck. It uses the given psedo random seed to mix up the cards, so a recorded seed reproduces the same deck. It returns void.
+static void reset(struct blackjack_table *table); //This function resets the game to its initial state. The game state and all game values are reset and the cards are reset to an ordered state. This function returns void
+static void write_msg(struct blackjack_table *table, enum bj_msg msg); //This function writes messages and information to a buffer to be printed in user space based on the actions of the player in the game. Messages are English sentences or, in BJ_FORMAT_COMPACT, their numeric code. It returns void
+static void append_msg(struct blackjack_table *table, const char *text, size_t len); //This function appends len bytes of text to the table's message buffer and keeps it NUL terminated. Text that does not fit is dropped. It returns void.
+static void clear_msgs(struct blackjack_table *table); //This function empties the table's message buffer once its contents have been read. It returns void.
 static int get_card_value(int num); //This function calculates the value of a card based on its number (0 - 51). It checks if the number is valid and then calculates the value. It returns ints. 11 for aces, 10 for face cards and face value for other cards.
-static int calculate_score(char player[]); //This function calculates the total score of the player or dealer's hand. It iterates through the hand calculating the value of each card using get_card_value(int). It totals the score and adjusts for aces to be valued as 1 if the total is > 21. It returns int. 
-static int deal(void); //This fuction deals a card from the deck. It iterates through the deck to find the first card that hasnt been dealt yet. Once found, it stores the card temporarily and replaces that card value with -1 in the deck for future dealing and then returns the card. It returns int.
+static int calculate_score(struct game_data *game, char player[]); //This function calculates the total score of the player or dealer's hand. It iterates through the hand calculating the value of each card using get_card_value(int). It totals the score and adjusts for aces to be valued as 1 if the total is > 21. It returns int. 
+static int deal(struct game_data *game); //This fuction deals a card from the deck. It iterates through the deck to find the first card that hasnt been dealt yet. Once found, it stores the card temporarily and replaces that card value with -1 in the deck for future dealing and then returns the card. It returns int.
+static void bot_play(struct work_struct *work); //This function is the work item of a bot player. It picks the next command for the bot's table from the game state, plays it and queues itself again. It returns void.
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = device_open,
     .release = device_close,
     .read = device_read,
-    .write = device_write
+    .write = device_write,
+    .unlocked_ioctl = device_ioctl,
+    .compat_ioctl = compat_ptr_ioctl
 };
 
 static struct miscdevice blackjack = {
@@ -37,59 +76,156 @@ static struct miscdevice blackjack = {
 };
 
 
-static const char *card_deck[] = {
-	"Ace of Spades\n",
-	"2 of Spades\n",
-	"3 of Spades\n",
-	"4 of Spades\n",
-	"5 of Spades\n",
-	"6 of Spades\n",
-	"7 of Spades\n",
-	"8 of Spades\n",
-	"9 of Spades\n",
-	"10 of Spades\n",
-	"Jack of Spades\n",
-	"Queen of Spades\n",
-	"King of Spades\n",
-	"Ace of Hearts\n",
-	"2 of Hearts\n",
-	"3 of Hearts\n",
-	"4 of Hearts\n",
-	"5 of Hearts\n",
-	"6 of Hearts\n",
-	"7 of Hearts\n",
-	"8 of Hearts\n",
-	"9 of Hearts\n",
-	"10 of Hearts\n",
-	"Jack of Hearts\n",
-	"Queen of Hearts\n",
-	"King of Hearts\n",
-	"Ace of Diamonds\n",
-	"2 of Diamonds\n",
-	"3 of Diamonds\n",
-	"4 of Diamonds\n",
-	"5 of Diamonds\n",
-	"6 of Diamonds\n",
-	"7 of Diamonds\n",
-	"8 of Diamonds\n",
-	"9 of Diamonds\n",
-	"10 of Diamonds\n",
-	"Jack of Diamonds\n",
-	"Queen of Diamonds\n",
-	"King of Diamonds\n",
-	"Ace of Clubs\n",
-	"2 of Clubs\n",
-	"3 of Clubs\n",
-	"4 of Clubs\n",
-	"5 of Clubs\n",
-	"6 of Clubs\n",
-	"7 of Clubs\n",
-	"8 of Clubs\n",
-	"9 of Clubs\n",
-	"10 of Clubs\n",
-	"Jack of Clubs\n",
-	"Queen of Clubs\n",
-	"King of Clubs\n"
+//Commands are looked up by a perfect hash of their first two letters. The table is laid out by the compiler from CMD_HASH,
+//matching is still by prefix, so "HIT\n" from echo is HIT.
+#define CMD_HASH(c0, c1) (((c0) + ((c1) << 2)) & 15)
+#define CMD_BIT(c0, c1) (1U << CMD_HASH(c0, c1))
+
+struct command_word {
+	const char *name;
+	unsigned char len;
+	enum bj_command command;
+};
+
+//Every command is listed once here, the lookup table and the collision check in parse_command() are both built from this list.
+#define COMMAND_WORDS(X) \
+	X('R', 'E', "RESET", BJ_CMD_RESET) \
+	X('S', 'H', "SHUFFLE", BJ_CMD_SHUFFLE) \
+	X('D', 'E', "DEAL", BJ_CMD_DEAL) \
+	X('H', 'I', "HIT", BJ_CMD_HIT) \
+	X('H', 'O', "HOLD", BJ_CMD_HOLD) \
+	X('Y', 'E', "YES", BJ_CMD_YES) \
+	X('N', 'O', "NO", BJ_CMD_NO)
+
+#define COMMAND_WORD_ENTRY(c0, c1, name, command) [CMD_HASH(c0, c1)] = { name, sizeof(name) - 1, command },
+#define COMMAND_WORD_BIT(c0, c1, name, command) | CMD_BIT(c0, c1)
+#define COMMAND_WORD_ONE(c0, c1, name, command) + 1
+
+static const struct command_word command_words[16] = {
+	COMMAND_WORDS(COMMAND_WORD_ENTRY)
+};
+
+struct message {
+	const char *text;
+	unsigned short len;
+};
+
+#define MSG(text) { text, sizeof(text) - 1 }
+
+static const struct message messages[] = {		//text format of each response, indexed by enum bj_msg
+	[BJ_MSG_INVALID_STATE] = MSG("Invalid Sequence of Commands; Perform RESET before SHUFFLE.\n"),
+	[BJ_MSG_INVALID_COMMAND] = MSG("Invalid Command.\n"),
+	[BJ_MSG_INVALID_DEAL] = MSG("Invalid Sequence of Commands; Perform RESET and SHUFFLE to begin a new game.\n"),
+	[BJ_MSG_MULTIPLE_DEAL] = MSG("Invalid Sequence of Commands; Cannot DEAL multiple times. Perform HIT or HOLD.\n"),
+	[BJ_MSG_INVALID_HIT_OR_HOLD] = MSG("Invalid Sequence of Commands; Perform DEAL before HIT or HOLD.\n"),
+	[BJ_MSG_RESET] = MSG("Deck Reset.\n"),
+	[BJ_MSG_SHUFFLE] = MSG("Deck Shuffled.\n"),
+	[BJ_MSG_PLAYERS_HAND] = MSG("Player has a total of "),
+	[BJ_MSG_DEALERS_HAND] = MSG("Dealer has a total of "),
+	[BJ_MSG_EMPTY_DECK] = MSG("Deck is empty. RESET and SHUFFLE to continue playing.\n"),
+	[BJ_MSG_CONTINUE_DECK] = MSG("You are continuing with the same deck. Enter DEAL to play\n"),
+	[BJ_MSG_NEW_DECK] = MSG("You are using a new deck. RESET and SHUFFLE to continue playing.\n"),
+	[BJ_MSG_YES_OR_NO] = MSG("Invalid Input. Enter YES or NO.\n"),
+	[BJ_MSG_BLACKJACK] = MSG("Blackjack! Player wins.\n"),
+	[BJ_MSG_PLAYER_BUSTS] = MSG("Player Busts! Dealer Wins.\n"),
+	[BJ_MSG_DEALER_BUSTS] = MSG("Dealer Busts! Player Wins.\n"),
+	[BJ_MSG_PLAYER_WINS] = MSG("Player is closer to 21. Player Wins!\n"),
+	[BJ_MSG_DEALER_WINS] = MSG("Dealer Wins!\n"),
+	[BJ_MSG_HIT_OR_HOLD] = MSG("HIT or HOLD?\n"),
+	[BJ_MSG_END_OF_GAME] = MSG("Game is over. Do you want to play again using the same deck? (YES or NO).\n"),
+	[BJ_MSG_INITIAL_DEAL] = MSG("Dealer has dealt 2 initial cards --- Player's hand:\n"),
+	[BJ_MSG_PLAYER_DRAWS] = MSG("Player has been dealt an additional card --- Player's hand:\n"),
+	[BJ_MSG_DEALER_REVEALS] = MSG("Dealer has drawn 2 initial cards --- Dealer's hand:\n"),
+	[BJ_MSG_DEALER_DRAWS] = MSG("Dealer draws a new card --- Dealer's hand:\n"),
+};
+
+static const struct message compact_messages[] = {		//compact format of each response, its code from enum bj_msg; a hand continues with its cards and total
+	[BJ_MSG_INVALID_STATE] = MSG("1\n"),
+	[BJ_MSG_INVALID_COMMAND] = MSG("2\n"),
+	[BJ_MSG_INVALID_DEAL] = MSG("3\n"),
+	[BJ_MSG_MULTIPLE_DEAL] = MSG("4\n"),
+	[BJ_MSG_INVALID_HIT_OR_HOLD] = MSG("5\n"),
+	[BJ_MSG_RESET] = MSG("6\n"),
+	[BJ_MSG_SHUFFLE] = MSG("7\n"),
+	[BJ_MSG_PLAYERS_HAND] = MSG("8"),
+	[BJ_MSG_DEALERS_HAND] = MSG("9"),
+	[BJ_MSG_EMPTY_DECK] = MSG("10\n"),
+	[BJ_MSG_CONTINUE_DECK] = MSG("11\n"),
+	[BJ_MSG_NEW_DECK] = MSG("12\n"),
+	[BJ_MSG_YES_OR_NO] = MSG("13\n"),
+	[BJ_MSG_BLACKJACK] = MSG("14\n"),
+	[BJ_MSG_PLAYER_BUSTS] = MSG("15\n"),
+	[BJ_MSG_DEALER_BUSTS] = MSG("16\n"),
+	[BJ_MSG_PLAYER_WINS] = MSG("17\n"),
+	[BJ_MSG_DEALER_WINS] = MSG("18\n"),
+	[BJ_MSG_HIT_OR_HOLD] = MSG("19\n"),
+	[BJ_MSG_END_OF_GAME] = MSG("20\n"),
+	[BJ_MSG_INITIAL_DEAL] = MSG("21\n"),
+	[BJ_MSG_PLAYER_DRAWS] = MSG("22\n"),
+	[BJ_MSG_DEALER_REVEALS] = MSG("23\n"),
+	[BJ_MSG_DEALER_DRAWS] = MSG("24\n"),
+};
+
+static const struct message card_deck[52] = {		//text format of each card, indexed by card number
+	MSG("Ace of Spades\n"),
+	MSG("2 of Spades\n"),
+	MSG("3 of Spades\n"),
+	MSG("4 of Spades\n"),
+	MSG("5 of Spades\n"),
+	MSG("6 of Spades\n"),
+	MSG("7 of Spades\n"),
+	MSG("8 of Spades\n"),
+	MSG("9 of Spades\n"),
+	MSG("10 of Spades\n"),
+	MSG("Jack of Spades\n"),
+	MSG("Queen of Spades\n"),
+	MSG("King of Spades\n"),
+	MSG("Ace of Hearts\n"),
+	MSG("2 of Hearts\n"),
+	MSG("3 of Hearts\n"),
+	MSG("4 of Hearts\n"),
+	MSG("5 of Hearts\n"),
+	MSG("6 of Hearts\n"),
+	MSG("7 of Hearts\n"),
+	MSG("8 of Hearts\n"),
+	MSG("9 of Hearts\n"),
+	MSG("10 of Hearts\n"),
+	MSG("Jack of Hearts\n"),
+	MSG("Queen of Hearts\n"),
+	MSG("King of Hearts\n"),
+	MSG("Ace of Diamonds\n"),
+	MSG("2 of Diamonds\n"),
+	MSG("3 of Diamonds\n"),
+	MSG("4 of Diamonds\n"),
+	MSG("5 of Diamonds\n"),
+	MSG("6 of Diamonds\n"),
+	MSG("7 of Diamonds\n"),
+	MSG("8 of Diamonds\n"),
+	MSG("9 of Diamonds\n"),
+	MSG("10 of Diamonds\n"),
+	MSG("Jack of Diamonds\n"),
+	MSG("Queen of Diamonds\n"),
+	MSG("King of Diamonds\n"),
+	MSG("Ace of Clubs\n"),
+	MSG("2 of Clubs\n"),
+	MSG("3 of Clubs\n"),
+	MSG("4 of Clubs\n"),
+	MSG("5 of Clubs\n"),
+	MSG("6 of Clubs\n"),
+	MSG("7 of Clubs\n"),
+	MSG("8 of Clubs\n"),
+	MSG("9 of Clubs\n"),
+	MSG("10 of Clubs\n"),
+	MSG("Jack of Clubs\n"),
+	MSG("Queen of Clubs\n"),
+	MSG("King of Clubs\n"),
+};
+
+static const struct message compact_cards[52] = {		//compact format of each card, indexed by card number
+	MSG(" 0"), MSG(" 1"), MSG(" 2"), MSG(" 3"), MSG(" 4"), MSG(" 5"), MSG(" 6"), MSG(" 7"), MSG(" 8"), MSG(" 9"), MSG(" 10"), MSG(" 11"), MSG(" 12"),
+	MSG(" 13"), MSG(" 14"), MSG(" 15"), MSG(" 16"), MSG(" 17"), MSG(" 18"), MSG(" 19"), MSG(" 20"), MSG(" 21"), MSG(" 22"), MSG(" 23"), MSG(" 24"), MSG(" 25"),
+	MSG(" 26"), MSG(" 27"), MSG(" 28"), MSG(" 29"), MSG(" 30"), MSG(" 31"), MSG(" 32"), MSG(" 33"), MSG(" 34"), MSG(" 35"), MSG(" 36"), MSG(" 37"), MSG(" 38"),
+	MSG(" 39"), MSG(" 40"), MSG(" 41"), MSG(" 42"), MSG(" 43"), MSG(" 44"), MSG(" 45"), MSG(" 46"), MSG(" 47"), MSG(" 48"), MSG(" 49"), MSG(" 50"), MSG(" 51"),
 };
 
 enum state {
@@ -110,9 +246,136 @@ struct game_data {
     int dealers_hand[15];
 };
 
-static char msg_buffer[5120] = {0};
-static struct game_data current_game;
-static DEFINE_MUTEX(blackjack_mutex);
+struct blackjack_recording {
+    struct bj_rec *records;
+    u32 count;
+    u32 capacity;		//record_max when the recording was started
+    u32 flags;			//BJ_REC_* flags reported in the recording header
+    u64 start_ns;		//wall clock time the recording was started
+    u64 last_ns;		//monotonic time of the previous recorded command
+    struct bj_rec_state initial;	//game state when the recording was started
+    bool active;
+    bool saved;			//copied out by BJ_IOC_REC_GET after it was stopped, the session may be freed
+};
+
+struct blackjack_table {
+    struct game_data game;
+    struct blackjack_recording rec;
+    u32 id;			//table number reported in netlink events
+    bool publish;		//send netlink events for this table
+    char msg_buffer[5120];
+    size_t msg_len;		//bytes used in msg_buffer, not counting the terminating NUL
+    u8 format;			//BJ_FORMAT_TEXT or BJ_FORMAT_COMPACT
+    struct mutex lock;			//held for the whole of a command, so a table only ever sees one player at a time
+};
+
+struct blackjack_bot {
+    struct blackjack_table table;
+    struct delayed_work work;
+    unsigned long hands;		//number of hands the bot has finished
+};
+
+static unsigned int record_max = 4096;
+module_param(record_max, uint, 0644);
+MODULE_PARM_DESC(record_max, "Maximum number of commands kept in a recording (at most BJ_REC_MAX_RECORDS)");
+
+static unsigned int session_timeout_secs = 600;
+static int session_timeout_set(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops session_timeout_ops = {
+    .set = session_timeout_set,
+    .get = param_get_uint,
+};
+module_param_cb(session_timeout_secs, &session_timeout_ops, &session_timeout_secs, 0644);
+MODULE_PARM_DESC(session_timeout_secs, "Seconds without a command after which a session's table is freed (0 keeps sessions until unload)");
+
+static unsigned int session_park_secs = 30;
+module_param(session_park_secs, uint, 0644);
+MODULE_PARM_DESC(session_park_secs, "Seconds without a command after which a session's table may be freed under memory pressure");
+
+static unsigned int max_sessions = 16384;
+module_param(max_sessions, uint, 0644);
+MODULE_PARM_DESC(max_sessions, "Maximum number of sessions with a table, further sessions get EBUSY");
+
+static unsigned int session_pool = 64;
+module_param(session_pool, uint, 0444);
+MODULE_PARM_DESC(session_pool, "Number of session tables preallocated at load time and kept for reuse (at most max_sessions)");
+
+static int bots;
+module_param(bots, int, 0444);
+MODULE_PARM_DESC(bots, "Number of in-kernel bot players started at load time, each playing its own table");
+
+static unsigned int bot_interval_ms = 10;
+module_param(bot_interval_ms, uint, 0644);
+MODULE_PARM_DESC(bot_interval_ms, "Delay in milliseconds between two commands of a bot player (0 plays as fast as the workqueue allows)");
+
+static int bot_stand_on = 17;
+module_param(bot_stand_on, int, 0644);
+MODULE_PARM_DESC(bot_stand_on, "Bot strategy: HIT while the player's total is below this value, HOLD otherwise");
+
+static int bot_stats_get(char *buffer, const struct kernel_param *kp);
+static const struct kernel_param_ops bot_stats_ops = {
+    .get = bot_stats_get,
+};
+module_param_cb(bot_stats, &bot_stats_ops, NULL, 0444);
+MODULE_PARM_DESC(bot_stats, "Hands finished by the bot players and hands per second since load");
+
+#define EVENT_BATCH 128		//events queued per CPU at most, later events are dropped until the next flush
+
+static const struct genl_multicast_group blackjack_mcgrps[] = {
+    { .name = BJ_GENL_MCGRP },
+};
+
+static struct genl_family blackjack_genl = {
+    .name = BJ_GENL_NAME,
+    .version = BJ_GENL_VERSION,
+    .maxattr = BJ_GENL_ATTR_MAX,
+    .module = THIS_MODULE,
+    .mcgrps = blackjack_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(blackjack_mcgrps),
+};
+
+struct event_batch {		//events are queued per CPU, so tables playing on different CPUs never share a lock
+	spinlock_t lock;		//taken by the publishing CPU and by flush_events()
+	unsigned int count;
+	u32 dropped;			//events lost since the last message that reached the multicast group
+	struct bj_event events[EVENT_BATCH];
+};
+
+static DEFINE_PER_CPU(struct event_batch, event_batches);
+static DECLARE_WORK(events_work, flush_events);
+
+struct blackjack_session {
+    struct blackjack_table table;
+    struct hlist_node hash;		//sessions hash table, keyed by session id
+    struct list_head lru;		//session_lru, least recently used first
+    pid_t sid;
+    unsigned long last_active;		//jiffies of the last command
+    int users;				//commands in flight, a busy session is never freed
+};
+
+static DEFINE_HASHTABLE(sessions, 10);
+static LIST_HEAD(session_lru);
+static unsigned int session_count;
+static unsigned int busy_sessions;		//sessions with a command in flight
+static bool sessions_started;			//the reaper may be queued, protected by the module's parameter lock
+static DEFINE_SPINLOCK(sessions_lock);	//protects the session hash, the lru list and the users count; nothing allocates or sleeps under it
+static struct kmem_cache *session_cache;
+static LIST_HEAD(pooled_sessions);		//free tables kept for new sessions, linked through lru
+static unsigned int pooled_count;
+static DECLARE_DELAYED_WORK(reap_work, reap_sessions);
+
+static unsigned long session_shrink_count(struct shrinker *shrinker, struct shrink_control *sc);
+static unsigned long session_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc);
+static struct shrinker session_shrinker = {
+    .count_objects = session_shrink_count,
+    .scan_objects = session_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static struct blackjack_bot *bot_players;
+static int bots_running;
+static unsigned long bots_started;		//jiffies when the bots were started
+static struct workqueue_struct *bot_wq;
 
 
 static int device_open(struct inode *inode, struct file *file) {
@@ -126,27 +389,40 @@ static int device_close(struct inode *inode, struct file *file) {
 }
 
 static ssize_t device_read(struct file *file, char __user *buff, size_t len, loff_t *offset){
+    struct blackjack_session *session = get_session(false);
+    struct blackjack_table *table;
     size_t bytes_to_copy;
     
+    if (IS_ERR(session)){
+    	return (PTR_ERR(session) == -ENOENT) ? 0 : PTR_ERR(session);	//no table yet, nothing to read
+    }
+    table = &session->table;
+    
+    mutex_lock(&table->lock);
     
-    if (len >= strlen(msg_buffer)){			//set bytes to copy to not go over the length of the userspace buffer
-    	bytes_to_copy = strlen(msg_buffer);
+    if (len >= table->msg_len){			//set bytes to copy to not go over the length of the userspace buffer
+    	bytes_to_copy = table->msg_len;
     } else{
     	bytes_to_copy = len;
     }
     
-    if(copy_to_user(buff, msg_buffer, bytes_to_copy)){
+    if(copy_to_user(buff, table->msg_buffer, bytes_to_copy)){
+    	mutex_unlock(&table->lock);
+    	put_session(session);
     	return -EFAULT;
     }
     
-    memset(msg_buffer, 0, 5120);
+    clear_msgs(table);
     
+    mutex_unlock(&table->lock);
+    put_session(session);
     return bytes_to_copy;
 }
 
 static ssize_t device_write(struct file *file, const char __user *buff, size_t len, loff_t *offset){
+	struct blackjack_session *session;
 	char command[16];
-	int i, card_dealt;
+	enum bj_command cmd;
 
 	if (len > (sizeof(command) - 1)){
 		return -EINVAL;
@@ -157,116 +433,141 @@ static ssize_t device_write(struct file *file, const char __user *buff, size_t l
 		return -EFAULT;
 	}
 
-	if (current_game.current_state == 4) {			//check if the game is over
-		if (strncasecmp(command, "YES", 3) == 0) {	//if user says yes to continuing with the same deck, reset the scores and their hands, set the game state to "reusingdeck"
-			mutex_lock(&blackjack_mutex);
-			current_game.current_state = 5;
-			current_game.player_score = 0;
-			current_game.dealer_score = 0;
-			memset(current_game.players_hand, -1, sizeof(current_game.players_hand));
-			memset(current_game.dealers_hand, -1, sizeof(current_game.dealers_hand));
-			mutex_unlock(&blackjack_mutex);
+	session = get_session(true);
+	if (IS_ERR(session)){
+		return PTR_ERR(session);
+	}
+
+	cmd = parse_command(command);
+	play_command(&session->table, cmd, (cmd == BJ_CMD_SHUFFLE) ? prandom_u32() : 0);	//the shuffle seed is drawn here so that a recording can replay it
+	
+	put_session(session);
+	
+	return len;
+}
+
+static enum bj_command parse_command(const char command[]){
+	const struct command_word *word;
+	
+	BUILD_BUG_ON(hweight16(0 COMMAND_WORDS(COMMAND_WORD_BIT)) != (0 COMMAND_WORDS(COMMAND_WORD_ONE)));	//one slot per command, the hash must stay perfect
+	
+	if (command[0] == '\0'){		//empty write, command[1] is not initialized
+		return BJ_CMD_INVALID;
+	}
+	
+	word = &command_words[CMD_HASH(toupper(command[0]), toupper(command[1]))];	//a single string compare confirms the hit
+	if ((word->name != NULL) && (strncasecmp(command, word->name, word->len) == 0)){
+		return word->command;
+	}
+	
+	return BJ_CMD_INVALID;
+}
+
+static void play_command(struct blackjack_table *table, enum bj_command command, u32 seed){
+	struct game_data *game = &table->game;
+	int i, card_dealt;
+
+	mutex_lock(&table->lock);
+	
+	if (table->rec.active){
+		record_command(table, command, seed);
+	}
+
+	if (game->current_state == 4) {			//check if the game is over
+		if (command == BJ_CMD_YES) {	//if user says yes to continuing with the same deck, reset the scores and their hands, set the game state to "reusingdeck"
+			game->current_state = 5;
+			game->player_score = 0;
+			game->dealer_score = 0;
+			memset(game->players_hand, -1, sizeof(game->players_hand));
+			memset(game->dealers_hand, -1, sizeof(game->dealers_hand));
 			
-			write_msg("CONTINUE DECK");
+			write_msg(table, BJ_MSG_CONTINUE_DECK);
 		}
-		else if (strncasecmp(command, "NO", 2) == 0) {	//if the user wants a new deck, set the gamestate to disabled so they have to begin afresh
-			current_game.current_state = 0;
+		else if (command == BJ_CMD_NO) {	//if the user wants a new deck, set the gamestate to disabled so they have to begin afresh
+			game->current_state = 0;
 			
-			write_msg("NEW DECK");
+			write_msg(table, BJ_MSG_NEW_DECK);
 		}
 		else {								//prompt for yes or no if the user enters something different
-			write_msg("YES OR NO");
+			write_msg(table, BJ_MSG_YES_OR_NO);
 		}
 	}
 
 
 
-	else if (strncasecmp(command, "RESET", 5) == 0){		//perform reset if the user enters "reset"
-		reset();
-		write_msg("RESET");
+	else if (command == BJ_CMD_RESET){		//perform reset if the user enters "reset"
+		reset(table);
+		write_msg(table, BJ_MSG_RESET);
 	}
 	
 	
 	
-	else if (strncasecmp(command, "SHUFFLE", 7) == 0){		//user enters "shuffle"
+	else if (command == BJ_CMD_SHUFFLE){		//user enters "shuffle"
 		
-		if ((current_game.current_state != 1) && (current_game.current_state != 2)){	//print error if user tries to shuffle at the wrong time
+		if ((game->current_state != 1) && (game->current_state != 2)){	//print error if user tries to shuffle at the wrong time
 			
-			write_msg("INVALID STATE");
+			write_msg(table, BJ_MSG_INVALID_STATE);
 		} 
 		else{
-			shuffle();
-			write_msg("SHUFFLE");
+			shuffle(table, seed);
+			write_msg(table, BJ_MSG_SHUFFLE);
+			publish_event(table, BJ_EVENT_RESHUFFLE, 0);
 		}
 	}
 	
 	
 	
-	else if (strncasecmp(command, "DEAL", 4) == 0){			//user enters "deal"
+	else if (command == BJ_CMD_DEAL){			//user enters "deal"
 	
-		if ((current_game.current_state != 2) && (current_game.current_state != 5)){	//print error if the user tries to deal at the wrong time
-			if (current_game.current_state != 3) {			//invalid deal error if they try to deal without reset and shuffle
-				write_msg("INVALID DEAL");
+		if ((game->current_state != 2) && (game->current_state != 5)){	//print error if the user tries to deal at the wrong time
+			if (game->current_state != 3) {			//invalid deal error if they try to deal without reset and shuffle
+				write_msg(table, BJ_MSG_INVALID_DEAL);
 			}
 			else {
-				write_msg("MULTIPLE DEAL");					//multiple deal error if user tries to deal after already dealing once in the same game
+				write_msg(table, BJ_MSG_MULTIPLE_DEAL);					//multiple deal error if user tries to deal after already dealing once in the same game
 			}
 		}
 		else {
-			calculate_score("PLAYER");	calculate_score("DEALER");
+			calculate_score(game, "PLAYER");	calculate_score(game, "DEALER");
 		
 			for (i = 0; i < 2; i++){		//deal 2 cards to player
-				card_dealt = deal();
+				card_dealt = deal(game);
 				
 				if (card_dealt == -1){		//handle the deck running out of cards
-					write_msg("EMPTY DECK");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 0;		
-					mutex_unlock(&blackjack_mutex);
+					write_msg(table, BJ_MSG_EMPTY_DECK);
+					game->current_state = 0;		
 					break;
 				}
 				
-				mutex_lock(&blackjack_mutex);
-				current_game.players_hand[i] = card_dealt;
-				mutex_unlock(&blackjack_mutex);
+				game->players_hand[i] = card_dealt;
 			}
 		
 			
 			for (i = 0; i < 2; i++){		//deal 2 cards to dealer
-				card_dealt = deal();
+				card_dealt = deal(game);
 				
 				if (card_dealt == -1){		//handle the deck running out of cards
-					write_msg("EMPTY DECK");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 0;
-					mutex_unlock(&blackjack_mutex);
+					write_msg(table, BJ_MSG_EMPTY_DECK);
+					game->current_state = 0;
 					break;
 				}
 				
-				mutex_lock(&blackjack_mutex);
-				current_game.dealers_hand[i] = card_dealt;
-				mutex_unlock(&blackjack_mutex);
+				game->dealers_hand[i] = card_dealt;
 			}
 			
 			if (card_dealt != -1) {					//proceed with the code if the deck is not empty
-				mutex_lock(&blackjack_mutex);
-				strcat(msg_buffer, "Dealer has dealt 2 initial cards --- Player's hand:\n");	//print out the player's hand
-				mutex_unlock(&blackjack_mutex);
-				write_msg("PLAYERS HAND");
+				write_msg(table, BJ_MSG_INITIAL_DEAL);	//print out the player's hand
+				write_msg(table, BJ_MSG_PLAYERS_HAND);
+				publish_event(table, BJ_EVENT_DEAL, 0);
 				
-				if (current_game.player_score == 21){	//if player has 21 after the first 2 cards are dealt (a blackjack), player wins, game ends
-					write_msg("BLACKJACK");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 4;
-					mutex_unlock(&blackjack_mutex);
-					
-					write_msg("END OF GAME");
+				if (game->player_score == 21){	//if player has 21 after the first 2 cards are dealt (a blackjack), player wins, game ends
+					write_msg(table, BJ_MSG_BLACKJACK);
+					publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_BLACKJACK);
+					game->current_state = 4;
+					write_msg(table, BJ_MSG_END_OF_GAME);
 				}
 				else {									//if the player doesnt have a blackjack after the first 2 card, ask if they want to hit or hold
-					write_msg("HIT OR HOLD");
+					write_msg(table, BJ_MSG_HIT_OR_HOLD);
 				}
 			}
 			
@@ -276,44 +577,39 @@ static ssize_t device_write(struct file *file, const char __user *buff, size_t l
 	
 	
 	
-	else if (strncasecmp(command, "HIT", 3) == 0){	//user enters "hit"
+	else if (command == BJ_CMD_HIT){	//user enters "hit"
 		
-		if (current_game.current_state != 3){		//if user enters hit at the wrong time, print an error
-			write_msg("INVALID HIT OR HOLD");
+		if (game->current_state != 3){		//if user enters hit at the wrong time, print an error
+			write_msg(table, BJ_MSG_INVALID_HIT_OR_HOLD);
 		}
 		else {										//else, deal a card
-			card_dealt = deal();
+			card_dealt = deal(game);
 				
 			if (card_dealt == -1){					//handle the deck running out of cards
-				write_msg("EMPTY DECK");
-				
-				mutex_lock(&blackjack_mutex);
-				current_game.current_state = 0;
-				mutex_unlock(&blackjack_mutex);
+				write_msg(table, BJ_MSG_EMPTY_DECK);
+				game->current_state = 0;
 			}
 			else {
 				i = 0;
-				while(current_game.players_hand[i] != -1) {
+				while((i < 15) && (game->players_hand[i] != -1)) {
 					i++;
 				}
-				mutex_lock(&blackjack_mutex);
-				current_game.players_hand[i] = card_dealt;
-				strcat(msg_buffer, "Player has been dealt an additional card --- Player's hand:\n");
-				mutex_unlock(&blackjack_mutex);
+				if (i < 15) {					//15 distinct cards are always over 21, a full hand has already busted
+					game->players_hand[i] = card_dealt;
+				}
+				write_msg(table, BJ_MSG_PLAYER_DRAWS);
 				
-				write_msg("PLAYERS HAND");
+				write_msg(table, BJ_MSG_PLAYERS_HAND);
+				publish_event(table, BJ_EVENT_ACTION, BJ_CMD_HIT);
 			
-				if (current_game.player_score > 21){	//check if player busts after a hit, if they do end the game, dealer wins
-					write_msg("PLAYER BUSTS");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 4;
-					mutex_unlock(&blackjack_mutex);
-					
-					write_msg("END OF GAME");
+				if (game->player_score > 21){	//check if player busts after a hit, if they do end the game, dealer wins
+					write_msg(table, BJ_MSG_PLAYER_BUSTS);
+					publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_PLAYER_BUSTS);
+					game->current_state = 4;
+					write_msg(table, BJ_MSG_END_OF_GAME);
 				}
 				else {									//if they dont, ask again if they want tohit or hold
-					write_msg("HIT OR HOLD");
+					write_msg(table, BJ_MSG_HIT_OR_HOLD);
 				}
 			}
 			
@@ -323,97 +619,76 @@ static ssize_t device_write(struct file *file, const char __user *buff, size_t l
 	
 	
 	
-	else if (strncasecmp(command, "HOLD", 4) == 0){			//user enters "hold"
+	else if (command == BJ_CMD_HOLD){			//user enters "hold"
 		
-		if (current_game.current_state != 3){				//if they entered hold at a worng time, print an error
-			write_msg("INVALID HIT OR HOLD");
+		if (game->current_state != 3){				//if they entered hold at a worng time, print an error
+			write_msg(table, BJ_MSG_INVALID_HIT_OR_HOLD);
 		}
 		else {												//else let the dealer draw cards
-			mutex_lock(&blackjack_mutex);
-			strcat(msg_buffer, "Dealer has drawn 2 initial cards --- Dealer's hand:\n");	//print out the cards the dealer initially drew
-			mutex_unlock(&blackjack_mutex);
-			write_msg("DEALERS HAND");
+			write_msg(table, BJ_MSG_DEALER_REVEALS);	//print out the cards the dealer initially drew
+			write_msg(table, BJ_MSG_DEALERS_HAND);
+			publish_event(table, BJ_EVENT_ACTION, BJ_CMD_HOLD);
 			
-			if (current_game.dealer_score >= 17) {			//if dealer's hand >= 17, check for a winner
-				if (current_game.dealer_score >= current_game.player_score) {
+			if (game->dealer_score >= 17) {			//if dealer's hand >= 17, check for a winner
+				if (game->dealer_score >= game->player_score) {
 					//dealer wins
-					write_msg("DEALER WINS");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 5;
-					mutex_unlock(&blackjack_mutex);
-					
-					write_msg("END OF GAME");
+					write_msg(table, BJ_MSG_DEALER_WINS);
+					publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_DEALER_WINS);
+					game->current_state = 5;
+					write_msg(table, BJ_MSG_END_OF_GAME);
 				}
 				else {
 					//player wins
-					write_msg("PLAYER WINS");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 4;
-					mutex_unlock(&blackjack_mutex);
-					
-					write_msg("END OF GAME");
+					write_msg(table, BJ_MSG_PLAYER_WINS);
+					publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_PLAYER_WINS);
+					game->current_state = 4;
+					write_msg(table, BJ_MSG_END_OF_GAME);
 				}
 			}
 			else {											//else, if dealer's hand is < 17, let the dealer draw until it reaches 17
 			
 				i = 0;
-				while(current_game.dealers_hand[i] != -1) {		//find first empty spot on dealers hand to deal a card to
+				while((i < 15) && (game->dealers_hand[i] != -1)) {		//find first empty spot on dealers hand to deal a card to
 					i++;
 				}
 			
-				while (calculate_score("DEALER") < 17) {
-					card_dealt = deal();
+				while ((i < 15) && (calculate_score(game, "DEALER") < 17)) {
+					card_dealt = deal(game);
 						
 					if (card_dealt == -1){						//handle the deck running out of cards
-						write_msg("EMPTY DECK");
-						
-						mutex_lock(&blackjack_mutex);
-						current_game.current_state = 0;
-						mutex_unlock(&blackjack_mutex);
+						write_msg(table, BJ_MSG_EMPTY_DECK);
+						game->current_state = 0;
 						break;
 					}
 					else {										//print out the dealer's hand after each card is drawn
-						mutex_lock(&blackjack_mutex);
-						current_game.dealers_hand[i++] = card_dealt;
-						strcat(msg_buffer, "Dealer draws a new card --- Dealer's hand:\n");
-						mutex_unlock(&blackjack_mutex);
-						write_msg("DEALERS HAND");
+						game->dealers_hand[i++] = card_dealt;
+						write_msg(table, BJ_MSG_DEALER_DRAWS);
+						write_msg(table, BJ_MSG_DEALERS_HAND);
 					}
 				}
 				
 				
-				if (current_game.dealer_score > 21) {			//if dealer draws over 21, dealer busts, player wins, game ends
+				if (game->dealer_score > 21) {			//if dealer draws over 21, dealer busts, player wins, game ends
 					//dealer busts
-					write_msg("DEALER BUSTS");
-					
-					mutex_lock(&blackjack_mutex);
-					current_game.current_state = 4;
-					mutex_unlock(&blackjack_mutex);
-					
-					write_msg("END OF GAME");
+					write_msg(table, BJ_MSG_DEALER_BUSTS);
+					publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_DEALER_BUSTS);
+					game->current_state = 4;
+					write_msg(table, BJ_MSG_END_OF_GAME);
 				}
 				else {		//if dealer is over 17 but not over 21
-					if (current_game.dealer_score >= current_game.player_score) {		//if dealer's hand is closer to 21 than player's hand or equal to player's hand, dealer wins, game ends	
+					if (game->dealer_score >= game->player_score) {		//if dealer's hand is closer to 21 than player's hand or equal to player's hand, dealer wins, game ends	
 						//dealer wins
-						write_msg("DEALER WINS");
-						
-						mutex_lock(&blackjack_mutex);
-						current_game.current_state = 4;
-						mutex_unlock(&blackjack_mutex);
-						
-						write_msg("END OF GAME");
+						write_msg(table, BJ_MSG_DEALER_WINS);
+						publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_DEALER_WINS);
+						game->current_state = 4;
+						write_msg(table, BJ_MSG_END_OF_GAME);
 					}
 					else {										//if player is closer to 21, player wins, game ends
 						//player wins
-						write_msg("PLAYER WINS");
-						
-						mutex_lock(&blackjack_mutex);
-						current_game.current_state = 4;
-						mutex_unlock(&blackjack_mutex);
-						
-						write_msg("END OF GAME");
+						write_msg(table, BJ_MSG_PLAYER_WINS);
+						publish_event(table, BJ_EVENT_OUTCOME, BJ_OUTCOME_PLAYER_WINS);
+						game->current_state = 4;
+						write_msg(table, BJ_MSG_END_OF_GAME);
 					}
 				}	
 			}
@@ -423,151 +698,114 @@ static ssize_t device_write(struct file *file, const char __user *buff, size_t l
 	
 	
 	else {													//print an invalid command error if an unknown command is entered
-		write_msg("INVALID COMMAND.");
+		write_msg(table, BJ_MSG_INVALID_COMMAND);
 	}
 	
-	
-	
-	return len;
+	mutex_unlock(&table->lock);
 }
 
-static void shuffle(){
+static void shuffle(struct blackjack_table *table, u32 seed){
+    struct game_data *game = &table->game;
     size_t i, j;
     int tmp;
-    unsigned int rand_gen = prandom_u32();
+    unsigned int rand_gen = seed;
 
-	mutex_lock(&blackjack_mutex);
-	current_game.current_state = 2;			//set the state to shuffle
+	game->current_state = 2;			//set the state to shuffle
 	
     for (i = 0; i < 52; i++) {				// go through each card in the deck and swap it with another randomly selected card in the deck
         j = (((i + 1) * 7) * rand_gen);
         j %= 52;
-        tmp = current_game.card_numbers[j];
-        current_game.card_numbers[j] = current_game.card_numbers[i];
-        current_game.card_numbers[i] = tmp;
+        tmp = game->card_numbers[j];
+        game->card_numbers[j] = game->card_numbers[i];
+        game->card_numbers[i] = tmp;
     }
-    
-    mutex_unlock(&blackjack_mutex);
 }
 
-static void reset(){			//reset all the game values
+static void reset(struct blackjack_table *table){			//reset all the game values
+	struct game_data *game = &table->game;
 	int i;
 	
-	mutex_lock(&blackjack_mutex);
-	current_game.current_state = 1;
-	current_game.player_score = 0;
-	current_game.dealer_score = 0;
+	game->current_state = 1;
+	game->player_score = 0;
+	game->dealer_score = 0;
 	
 	for (i = 0; i < 52; i++){
-		current_game.card_numbers[i] = i;
+		game->card_numbers[i] = i;
 	}
 
-	memset(current_game.players_hand, -1, sizeof(current_game.players_hand));
-	memset(current_game.dealers_hand, -1, sizeof(current_game.dealers_hand));
+	memset(game->players_hand, -1, sizeof(game->players_hand));
+	memset(game->dealers_hand, -1, sizeof(game->dealers_hand));
+}
+
+static void append_msg(struct blackjack_table *table, const char *text, size_t len){
+	if ((table->msg_len + len) >= sizeof(table->msg_buffer)){	//keep room for the terminating NUL
+		return;
+	}
 	
-	mutex_unlock(&blackjack_mutex);
+	memcpy(table->msg_buffer + table->msg_len, text, len);
+	table->msg_len += len;
+	table->msg_buffer[table->msg_len] = '\0';
 }
 
-static void write_msg(char msg[]){
-	int i;
-	char tmp[10];
+static void clear_msgs(struct blackjack_table *table){
+	table->msg_len = 0;
+	table->msg_buffer[0] = '\0';
+}
+
+static void write_msg(struct blackjack_table *table, enum bj_msg msg){
+	struct game_data *game = &table->game;
+	int *hand;
+	int i, len;
+	char tmp[16];
 	
-	mutex_lock(&blackjack_mutex);
+	BUILD_BUG_ON(ARRAY_SIZE(compact_messages) != ARRAY_SIZE(messages));	//every response has a code
 	
-	if ((strlen(msg_buffer) + 75) > 5120){
-		mutex_unlock(&blackjack_mutex);
+	if ((table->msg_len + 75) > sizeof(table->msg_buffer)){
 		printk(KERN_ERR "No more space in user message buffer. cat /dev/blackjack to read and clear the buffer\n");
 		return;
 	}
 	
-	if (strncmp(msg, "INVALID STATE", 13) == 0){
-		strcat(msg_buffer, "Invalid Sequence of Commands; Perform RESET before SHUFFLE.\n");
-	}
-	else if (strncmp(msg, "INVALID COMMAND", 15) == 0){
-		strcat(msg_buffer, "Invalid Command.\n");
-	}
-	else if (strncmp(msg, "INVALID DEAL", 12) == 0){
-		strcat(msg_buffer, "Invalid Sequence of Commands; Perform RESET and SHUFFLE to begin a new game.\n");
-	}
-	else if (strncmp(msg, "MULTIPLE DEAL", 13) == 0){
-		strcat(msg_buffer, "Invalid Sequence of Commands; Cannot DEAL multiple times. Perform HIT or HOLD.\n");
-	}
-	else if (strncmp(msg, "INVALID HIT OR HOLD", 19) == 0){
-		strcat(msg_buffer, "Invalid Sequence of Commands; Perform DEAL before HIT or HOLD.\n");
-	}
-	else if (strncmp(msg, "RESET", 5) == 0){
-		strcat(msg_buffer, "Deck Reset.\n");
-	}
-	else if (strncmp(msg, "SHUFFLE", 7) == 0){
-		strcat(msg_buffer, "Deck Shuffled.\n");
+	if ((msg >= ARRAY_SIZE(messages)) || (messages[msg].text == NULL)){
+		printk(KERN_ALERT "No such message exists.");
+		return;
 	}
-	else if (strncmp(msg, "PLAYERS HAND", 12) == 0){
-		for (i = 0; i < 15; i++){					//go through each card in player's hand and print out their suit and values
-			if(current_game.players_hand[i] == -1){			
-				mutex_unlock(&blackjack_mutex);
-				break;
-			}
-			else{
-				strcat(msg_buffer, card_deck[current_game.players_hand[i]]);
-			}
+	
+	if ((msg != BJ_MSG_PLAYERS_HAND) && (msg != BJ_MSG_DEALERS_HAND)){
+		if (table->format == BJ_FORMAT_COMPACT){
+			append_msg(table, compact_messages[msg].text, compact_messages[msg].len);
 		}
-		snprintf(tmp, 10, "%d\n\n", calculate_score("PLAYER"));		//calculate total and print it out as well
-		strcat(msg_buffer, "Player has a total of ");
-		strcat(msg_buffer, tmp);
-	}
-	else if (strncmp(msg, "DEALERS HAND", 12) == 0){
-		for (i = 0; i < 15; i++){					//go through each card in player's hand and print out their suit and values
-			if(current_game.dealers_hand[i] == -1){
-				mutex_unlock(&blackjack_mutex);
-				break;
-			}
-			else{
-				strcat(msg_buffer, card_deck[current_game.dealers_hand[i]]);
-			}
+		else {
+			append_msg(table, messages[msg].text, messages[msg].len);
 		}
-		snprintf(tmp, 10, "%d\n\n", calculate_score("DEALER"));		//calculate total and print it out
-		strcat(msg_buffer, "Dealer has a total of ");
-		strcat(msg_buffer, tmp);
-	}
-	else if (strncmp(msg, "EMPTY DECK", 10) == 0){
-		strcat(msg_buffer, "Deck is empty. RESET and SHUFFLE to continue playing.\n");
-	}
-	else if (strncmp(msg, "CONTINUE DECK", 13) == 0){
-		strcat(msg_buffer, "You are continuing with the same deck. Enter DEAL to play\n");
-	}
-	else if (strncmp(msg, "NEW DECK", 8) == 0){
-		strcat(msg_buffer, "You are using a new deck. RESET and SHUFFLE to continue playing.\n");
-	}
-	else if (strncmp(msg, "YES OR NO", 9) == 0){
-		strcat(msg_buffer, "Invalid Input. Enter YES or NO.\n");
-	}
-	else if (strncmp(msg, "BLACKJACK", 9) == 0){
-		strcat(msg_buffer, "Blackjack! Player wins.\n");
-	}
-	else if (strncmp(msg, "PLAYER BUSTS", 12) == 0){
-		strcat(msg_buffer, "Player Busts! Dealer Wins.\n");
-	}
-	else if (strncmp(msg, "DEALER BUSTS", 12) == 0){
-		strcat(msg_buffer, "Dealer Busts! Player Wins.\n");
-	}
-	else if (strncmp(msg, "PLAYER WINS", 11) == 0){
-		strcat(msg_buffer, "Player is closer to 21. Player Wins!\n");
+		return;
 	}
-	else if (strncmp(msg, "DEALER WINS", 11) == 0){
-		strcat(msg_buffer, "Dealer Wins!\n");
+	
+	hand = (msg == BJ_MSG_PLAYERS_HAND) ? game->players_hand : game->dealers_hand;
+	if (table->format == BJ_FORMAT_COMPACT){
+		append_msg(table, compact_messages[msg].text, compact_messages[msg].len);
 	}
-	else if (strncmp(msg, "HIT OR HOLD", 9) == 0){
-		strcat(msg_buffer, "HIT or HOLD?\n");
+	
+	for (i = 0; i < 15; i++){					//go through each card in the hand and print out their suit and values
+		if(hand[i] == -1){			
+			break;
+		}
+		else if (table->format == BJ_FORMAT_COMPACT){
+			append_msg(table, compact_cards[hand[i]].text, compact_cards[hand[i]].len);
+		}
+		else{
+			append_msg(table, card_deck[hand[i]].text, card_deck[hand[i]].len);
+		}
 	}
-	else if (strncmp(msg, "END OF GAME", 11) == 0){
-		strcat(msg_buffer, "Game is over. Do you want to play again using the same deck? (YES or NO).\n");
+	
+	if (table->format == BJ_FORMAT_COMPACT){
+		len = scnprintf(tmp, sizeof(tmp), " %d\n", calculate_score(game, (msg == BJ_MSG_PLAYERS_HAND) ? "PLAYER" : "DEALER"));
+		append_msg(table, tmp, len);
 	}
 	else {
-		printk(KERN_ALERT "No such message exists.");
+		len = scnprintf(tmp, sizeof(tmp), "%d\n\n", calculate_score(game, (msg == BJ_MSG_PLAYERS_HAND) ? "PLAYER" : "DEALER"));		//calculate total and print it out as well
+		append_msg(table, messages[msg].text, messages[msg].len);
+		append_msg(table, tmp, len);
 	}
-	
-	mutex_unlock(&blackjack_mutex);
-	return;
 }
 
 static int get_card_value(int num){		//calculate the value of a card based on its number 0 - 51 using the modulus operator
@@ -591,13 +829,13 @@ static int get_card_value(int num){		//calculate the value of a card based on it
 	}
 }
 
-static int calculate_score(char player[]){
+static int calculate_score(struct game_data *game, char player[]){
 	int i, total, ret, aces;
 	total = 0;	aces = 0;
 	
 	if (strncmp(player, "PLAYER", 6) == 0){
-		for (i = 0; i < 15; i++){					//loop throught the player's hand
-			if(current_game.players_hand[i] == -1){		
+		for (i = 0; i <= 15; i++){					//loop throught the player's hand, a full hand ends at 15
+			if((i == 15) || (game->players_hand[i] == -1)){		
 				
 				while(total > 21){			//drop the values of any aces from 11 to 1 if the total goes over 21
 					if (aces > 0){
@@ -609,13 +847,11 @@ static int calculate_score(char player[]){
 					}
 				}
 				
-				mutex_lock(&blackjack_mutex);
-				current_game.player_score = total;
-				mutex_unlock(&blackjack_mutex);
+				game->player_score = total;
 				return total;
 			}
 			
-			ret = get_card_value(current_game.players_hand[i]);
+			ret = get_card_value(game->players_hand[i]);
 			if(ret == -1){
 				return -1;
 			}
@@ -629,8 +865,8 @@ static int calculate_score(char player[]){
 		}
 	}
 	else if ((strncmp(player, "DEALER", 6) == 0)){
-		for (i = 0; i < 15; i++){					//loop throught the dealer's hand
-			if(current_game.dealers_hand[i] == -1){
+		for (i = 0; i <= 15; i++){					//loop throught the dealer's hand, a full hand ends at 15
+			if((i == 15) || (game->dealers_hand[i] == -1)){
 			
 				while(total > 21){						//drop the values of any aces from 11 to 1 if the total goes over 21
 					if (aces > 0){
@@ -642,13 +878,11 @@ static int calculate_score(char player[]){
 					}
 				}
 			
-				mutex_lock(&blackjack_mutex);
-				current_game.dealer_score = total;
-				mutex_unlock(&blackjack_mutex);
+				game->dealer_score = total;
 				return total;
 			}
 			
-			ret = get_card_value(current_game.dealers_hand[i]);
+			ret = get_card_value(game->dealers_hand[i]);
 			if(ret == -1){
 				return -1;
 			}
@@ -668,20 +902,18 @@ static int calculate_score(char player[]){
 	return total;
 }
 
-static int deal(){
+static int deal(struct game_data *game){
 	int i, tmp;
 	
 	//return the next card in the deck, replace each returned card with -1
 	for (i = 0; i < 52; i++){
-		if (current_game.card_numbers[i] == -1){
+		if (game->card_numbers[i] == -1){
 			continue;
 		}
 		else{
-			tmp = current_game.card_numbers[i];
-			mutex_lock(&blackjack_mutex);
-			current_game.card_numbers[i] = -1;
-			current_game.current_state = 3;
-			mutex_unlock(&blackjack_mutex);
+			tmp = game->card_numbers[i];
+			game->card_numbers[i] = -1;
+			game->current_state = 3;
 			return tmp;
 		}
 	}
@@ -689,25 +921,807 @@ static int deal(){
 	return -1;
 }
 
+static void init_table(struct blackjack_table *table){		//initialize game values
+	mutex_init(&table->lock);
+	clear_msgs(table);
+	table->format = BJ_FORMAT_TEXT;
+	memset(&table->rec, 0, sizeof(table->rec));
+	table->id = 0;
+	table->publish = true;
+	table->game.current_state = 0;
+	table->game.player_score = 0;
+	table->game.dealer_score = 0;
+}
+
+static void publish_event(struct blackjack_table *table, u8 type, u8 detail){
+	struct event_batch *batch;
+	struct bj_event *event;
+	
+	if (!table->publish || !genl_has_listeners(&blackjack_genl, &init_net, 0)){	//nobody subscribed, keep the command path free of event work
+		return;
+	}
+	
+	batch = get_cpu_ptr(&event_batches);
+	spin_lock(&batch->lock);
+	
+	if (batch->count == EVENT_BATCH){
+		batch->dropped++;
+		goto out;
+	}
+	
+	event = &batch->events[batch->count++];
+	event->timestamp_ns = ktime_get_ns();
+	event->table = table->id;
+	event->type = type;
+	event->detail = detail;
+	event->player_score = clamp(table->game.player_score, 0, 255);
+	event->dealer_score = clamp(table->game.dealer_score, 0, 255);
+	
+	if (batch->count == 1){		//first event of a batch, the flush picks up everything queued until it runs
+		schedule_work(&events_work);
+	}
+	
+out:
+	spin_unlock(&batch->lock);
+	put_cpu_ptr(&event_batches);
+}
+
+static void flush_batch(struct event_batch *batch){
+	struct sk_buff *skb;
+	void *hdr;
+	unsigned int count;
+	int ret = -ENOMEM;
+	
+	skb = genlmsg_new(nla_total_size(sizeof(batch->events)) + nla_total_size(sizeof(u32)), GFP_KERNEL);
+	hdr = skb ? genlmsg_put(skb, 0, 0, &blackjack_genl, 0, BJ_GENL_CMD_EVENTS) : NULL;
+	
+	spin_lock(&batch->lock);
+	count = batch->count;
+	if (hdr){
+		ret = nla_put(skb, BJ_GENL_ATTR_EVENTS, count * sizeof(struct bj_event), batch->events);
+		if (ret == 0){
+			ret = nla_put_u32(skb, BJ_GENL_ATTR_DROPPED, batch->dropped);
+		}
+	}
+	if (ret == 0){
+		batch->dropped = 0;
+	}
+	else {
+		batch->dropped += count;	//report the lost batch with the next message
+	}
+	batch->count = 0;
+	spin_unlock(&batch->lock);
+	
+	if ((ret < 0) || (count == 0)){
+		nlmsg_free(skb);
+		return;
+	}
+	
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&blackjack_genl, skb, 0, 0, GFP_KERNEL);
+}
+
+static void flush_events(struct work_struct *work){
+	struct event_batch *batch;
+	int cpu;
+	
+	for_each_possible_cpu(cpu){
+		batch = per_cpu_ptr(&event_batches, cpu);
+		if (READ_ONCE(batch->count) > 0){		//an event queued after this check schedules the work again
+			flush_batch(batch);
+		}
+	}
+}
+
+static bool hand_finished(int before, int after){		//a hand ends when DEAL, HIT or HOLD moves the game to END or REUSINGDECK
+	return (before != END) && (before != after) && ((after == END) || (after == REUSINGDECK));
+}
+
+static void record_command(struct blackjack_table *table, enum bj_command command, u32 seed){
+	struct blackjack_recording *rec = &table->rec;
+	struct bj_rec *entry;
+	u64 now = ktime_get_ns();
+	u64 delta_us = div_u64(now - rec->last_ns, 1000);
+	
+	if (rec->count >= rec->capacity){
+		rec->flags |= BJ_REC_OVERFLOW;
+		return;
+	}
+	
+	entry = &rec->records[rec->count++];
+	entry->delta_us = min_t(u64, delta_us, U32_MAX);
+	entry->command = command;
+	memset(entry->pad, 0, sizeof(entry->pad));
+	entry->seed = (command == BJ_CMD_SHUFFLE) ? seed : 0;
+	rec->last_ns = now;
+}
+
+static void save_game(const struct game_data *game, struct bj_rec_state *saved){
+	int i;
+	
+	for (i = 0; i < 52; i++){
+		saved->deck[i] = game->card_numbers[i];
+	}
+	for (i = 0; i < 15; i++){
+		saved->players_hand[i] = game->players_hand[i];
+		saved->dealers_hand[i] = game->dealers_hand[i];
+	}
+	saved->state = game->current_state;
+	saved->pad = 0;
+	saved->player_score = game->player_score;
+	saved->dealer_score = game->dealer_score;
+}
+
+static bool restore_card(int card, u64 *seen){		//a card may only be in the deck or in one hand, and only once
+	if (card == -1){
+		return true;
+	}
+	if ((card < 0) || (card > 51) || (*seen & BIT_ULL(card))){
+		return false;
+	}
+	*seen |= BIT_ULL(card);
+	return true;
+}
+
+static bool restore_game(struct game_data *game, const struct bj_rec_state *saved){	//the state comes from user space, check every card before using it
+	u64 seen = 0;
+	int i;
+	
+	if (saved->state > REUSINGDECK){
+		return false;
+	}
+	for (i = 0; i < 52; i++){
+		if (!restore_card(saved->deck[i], &seen)){
+			return false;
+		}
+		game->card_numbers[i] = saved->deck[i];
+	}
+	for (i = 0; i < 15; i++){
+		if (!restore_card(saved->players_hand[i], &seen) || !restore_card(saved->dealers_hand[i], &seen)){
+			return false;
+		}
+		if ((i > 0) && (((saved->players_hand[i] != -1) && (saved->players_hand[i - 1] == -1)) ||
+		                ((saved->dealers_hand[i] != -1) && (saved->dealers_hand[i - 1] == -1)))){	//hands are walked up to the first -1, no gaps
+			return false;
+		}
+		game->players_hand[i] = saved->players_hand[i];
+		game->dealers_hand[i] = saved->dealers_hand[i];
+	}
+	if ((game->players_hand[14] != -1) || (game->dealers_hand[14] != -1)){	//leave room for the next card
+		return false;
+	}
+	game->current_state = saved->state;
+	calculate_score(game, "PLAYER");	calculate_score(game, "DEALER");	//the saved scores are only informational
+	
+	return true;
+}
+
+static long start_recording(struct blackjack_table *table){
+	struct blackjack_recording *rec = &table->rec;
+	struct bj_rec *records;
+	u32 capacity = min_t(u32, READ_ONCE(record_max), BJ_REC_MAX_RECORDS);
+	
+	records = kvmalloc_array(capacity, sizeof(*records), GFP_KERNEL);	//allocate before locking, the table keeps playing meanwhile
+	if (!records){
+		return -ENOMEM;
+	}
+	
+	mutex_lock(&table->lock);
+	kvfree(rec->records);
+	rec->records = records;
+	rec->count = 0;
+	rec->capacity = capacity;
+	rec->flags = 0;
+	rec->start_ns = ktime_get_real_ns();
+	rec->last_ns = ktime_get_ns();
+	save_game(&table->game, &rec->initial);		//the recording may start in the middle of a game
+	rec->active = true;
+	rec->saved = false;
+	mutex_unlock(&table->lock);
+	
+	return 0;
+}
+
+static long get_recording(struct blackjack_table *table, struct bj_rec_buf __user *arg){
+	struct blackjack_recording *rec = &table->rec;
+	struct bj_rec_header header;
+	struct bj_rec_buf buf;
+	long ret = 0;
+	
+	if (copy_from_user(&buf, arg, sizeof(buf))){
+		return -EFAULT;
+	}
+	
+	mutex_lock(&table->lock);
+	
+	header.magic = BJ_REC_MAGIC;
+	header.version = BJ_REC_VERSION;
+	header.record_size = sizeof(struct bj_rec);
+	header.count = rec->count;
+	header.flags = rec->flags;
+	header.start_ns = rec->start_ns;
+	header.initial = rec->initial;
+	buf.used = sizeof(header) + (rec->count * sizeof(struct bj_rec));
+	
+	if (buf.len < buf.used){				//tell the caller how much space the recording needs
+		ret = -ENOSPC;
+	}
+	else if (copy_to_user(u64_to_user_ptr(buf.data), &header, sizeof(header)) ||
+	         copy_to_user(u64_to_user_ptr(buf.data + sizeof(header)), rec->records, rec->count * sizeof(struct bj_rec))){
+		ret = -EFAULT;
+	}
+	else {
+		rec->saved = !rec->active;		//a running recording can still grow, it is only saved once fetched after BJ_IOC_REC_STOP
+	}
+	
+	mutex_unlock(&table->lock);
+	
+	if (put_user(buf.used, &arg->used)){
+		return -EFAULT;
+	}
+	return ret;
+}
+
+static long replay(struct bj_replay __user *arg){
+	struct blackjack_table *scratch;
+	struct bj_rec_header header;
+	struct bj_rec *records;
+	struct bj_replay req;
+	enum bj_command command;
+	u64 start;
+	u32 i;
+	int before;
+	long ret = 0;
+	
+	if (copy_from_user(&req, arg, sizeof(req))){
+		return -EFAULT;
+	}
+	if ((req.len < sizeof(header)) || copy_from_user(&header, u64_to_user_ptr(req.data), sizeof(header))){
+		return (req.len < sizeof(header)) ? -EINVAL : -EFAULT;
+	}
+	
+	if ((header.magic != BJ_REC_MAGIC) || (header.version != BJ_REC_VERSION) || (header.record_size != sizeof(struct bj_rec)) ||
+	    (header.count > BJ_REC_MAX_RECORDS) || (req.len < sizeof(header) + ((size_t)header.count * sizeof(struct bj_rec)))){
+		return -EINVAL;
+	}
+	
+	records = vmemdup_user(u64_to_user_ptr(req.data + sizeof(header)), (size_t)header.count * sizeof(struct bj_rec));
+	if (IS_ERR(records)){
+		return PTR_ERR(records);
+	}
+	
+	scratch = kmalloc(sizeof(*scratch), GFP_KERNEL);
+	if (!scratch){
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	init_table(scratch);
+	scratch->publish = false;		//a replay is not live table traffic
+	if (!restore_game(&scratch->game, &header.initial)){	//start from the game the recording started on
+		ret = -EINVAL;
+		goto out_scratch;
+	}
+	
+	req.hands = 0;
+	start = ktime_get_ns();
+	for (i = 0; i < header.count; i++){		//timestamps are ignored, the replay runs at full speed
+		command = records[i].command;
+		if (command > BJ_CMD_NO){
+			command = BJ_CMD_INVALID;
+		}
+		
+		before = scratch->game.current_state;
+		play_command(scratch, command, records[i].seed);
+		if (hand_finished(before, scratch->game.current_state)){
+			req.hands++;
+		}
+		
+		if (req.flags & BJ_REPLAY_LOG){
+			printk(KERN_DEBUG "%s", scratch->msg_buffer);
+		}
+		clear_msgs(scratch);
+		cond_resched();
+	}
+	req.elapsed_ns = ktime_get_ns() - start;
+	
+	req.commands = header.count;
+	req.state = scratch->game.current_state;
+	req.player_score = scratch->game.player_score;
+	req.dealer_score = scratch->game.dealer_score;
+	
+	if (copy_to_user(arg, &req, sizeof(req))){
+		ret = -EFAULT;
+	}
+	
+out_scratch:
+	kfree(scratch);
+out_free:
+	kvfree(records);
+	return ret;
+}
+
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+	struct blackjack_session *session;
+	long ret;
+	
+	switch (cmd) {
+	case BJ_IOC_REPLAY:
+		return replay((struct bj_replay __user *)arg);
+	case BJ_IOC_SET_FORMAT:
+		if ((arg != BJ_FORMAT_TEXT) && (arg != BJ_FORMAT_COMPACT)){
+			return -EINVAL;
+		}
+		break;
+	case BJ_IOC_REC_START:
+	case BJ_IOC_REC_STOP:
+	case BJ_IOC_REC_GET:
+		break;
+	default:
+		return -ENOTTY;
+	}
+	
+	session = get_session((cmd == BJ_IOC_REC_START) || (cmd == BJ_IOC_SET_FORMAT));		//recordings and the output format belong to the caller's session
+	if (IS_ERR(session)){
+		return PTR_ERR(session);
+	}
+	
+	switch (cmd) {
+	case BJ_IOC_REC_START:
+		ret = start_recording(&session->table);
+		break;
+	case BJ_IOC_SET_FORMAT:
+		mutex_lock(&session->table.lock);
+		session->table.format = arg;
+		mutex_unlock(&session->table.lock);
+		ret = 0;
+		break;
+	case BJ_IOC_REC_STOP:
+		mutex_lock(&session->table.lock);
+		session->table.rec.active = false;
+		mutex_unlock(&session->table.lock);
+		ret = 0;
+		break;
+	default:
+		ret = get_recording(&session->table, (struct bj_rec_buf __user *)arg);
+		break;
+	}
+	
+	put_session(session);
+	return ret;
+}
+
+static void bot_play(struct work_struct *work){
+	struct blackjack_bot *bot = container_of(to_delayed_work(work), struct blackjack_bot, work);
+	struct game_data *game = &bot->table.game;
+	enum state before = game->current_state;	//only this work item plays the bot's table
+	
+	switch (before) {		//walk the RESET, SHUFFLE, DEAL, HIT/HOLD, YES cycle
+	case DISABLED:
+		play_command(&bot->table, BJ_CMD_RESET, 0);
+		break;
+	case RESET:
+		play_command(&bot->table, BJ_CMD_SHUFFLE, prandom_u32());
+		break;
+	case SHUFFLED:
+	case REUSINGDECK:
+		play_command(&bot->table, BJ_CMD_DEAL, 0);
+		break;
+	case DEAL:
+		play_command(&bot->table, (game->player_score < bot_stand_on) ? BJ_CMD_HIT : BJ_CMD_HOLD, 0);
+		break;
+	case END:
+		play_command(&bot->table, BJ_CMD_YES, 0);
+		break;
+	}
+	
+	if (hand_finished(before, game->current_state)){
+		WRITE_ONCE(bot->hands, bot->hands + 1);		//the command finished a hand
+	}
+	
+	clear_msgs(&bot->table);		//nobody reads a bot's table, drop the dealer's responses
+	
+	queue_delayed_work(bot_wq, &bot->work, msecs_to_jiffies(bot_interval_ms));
+}
+
+static int bot_stats_get(char *buffer, const struct kernel_param *kp){		//called with the module's parameter lock held
+	unsigned long hands = 0, elapsed_ms;
+	int i;
+	
+	for (i = 0; i < bots_running; i++){
+		hands += READ_ONCE(bot_players[i].hands);
+	}
+	elapsed_ms = jiffies_to_msecs(jiffies - bots_started);
+	if (elapsed_ms == 0){
+		elapsed_ms = 1;
+	}
+	
+	return sprintf(buffer, "bots: %d hands: %lu hands/sec: %lu\n", bots_running, hands, hands * 1000 / elapsed_ms);
+}
+
+static int start_bots(void){
+	int i;
+	
+	if (bots <= 0){
+		return 0;
+	}
+	
+	bot_wq = alloc_workqueue("blackjack_bots", WQ_UNBOUND, 0);
+	if (!bot_wq){
+		return -ENOMEM;
+	}
+	
+	bot_players = kvcalloc(bots, sizeof(*bot_players), GFP_KERNEL);
+	if (!bot_players){
+		destroy_workqueue(bot_wq);
+		return -ENOMEM;
+	}
+	
+	for (i = 0; i < bots; i++){
+		init_table(&bot_players[i].table);
+		bot_players[i].table.id = BJ_TABLE_BOT | i;
+		INIT_DELAYED_WORK(&bot_players[i].work, bot_play);
+	}
+	
+	kernel_param_lock(THIS_MODULE);
+	bots_running = bots;
+	bots_started = jiffies;
+	kernel_param_unlock(THIS_MODULE);
+	
+	for (i = 0; i < bots; i++){
+		queue_delayed_work(bot_wq, &bot_players[i].work, 0);
+	}
+	
+	printk(KERN_INFO "Blackjack started %d bot players\n", bots);
+	return 0;
+}
+
+static void stop_bots(void){
+	char stats[128];
+	int i;
+	
+	if (!bot_players){
+		return;
+	}
+	
+	for (i = 0; i < bots; i++){
+		cancel_delayed_work_sync(&bot_players[i].work);
+	}
+	destroy_workqueue(bot_wq);
+	
+	kernel_param_lock(THIS_MODULE);
+	bot_stats_get(stats, NULL);
+	bots_running = 0;
+	kernel_param_unlock(THIS_MODULE);
+	printk(KERN_INFO "Blackjack bot players stopped, %s", stats);
+	
+	kvfree(bot_players);
+	bot_players = NULL;
+}
+
+static struct blackjack_session *find_session(pid_t sid){		//called with sessions_lock held
+	struct blackjack_session *session;
+	
+	hash_for_each_possible(sessions, session, hash, sid){
+		if (session->sid == sid){
+			return session;
+		}
+	}
+	return NULL;
+}
+
+static unsigned int pool_size(void){
+	return min_t(unsigned int, session_pool, READ_ONCE(max_sessions));
+}
+
+static struct blackjack_session *alloc_session(void){		//a pooled table if one is left, a new one otherwise
+	struct blackjack_session *session = NULL;
+	
+	spin_lock(&sessions_lock);
+	if (!list_empty(&pooled_sessions)){
+		session = list_first_entry(&pooled_sessions, struct blackjack_session, lru);
+		list_del(&session->lru);
+		pooled_count--;
+	}
+	spin_unlock(&sessions_lock);
+	
+	return session ? session : kmem_cache_alloc(session_cache, GFP_KERNEL);
+}
+
+static void free_session(struct blackjack_session *session){	//refills the pool first, tables beyond it go back to the slab
+	bool pooled = false;
+	
+	kvfree(session->table.rec.records);
+	session->table.rec.records = NULL;
+	
+	spin_lock(&sessions_lock);
+	if (pooled_count < pool_size()){
+		list_add(&session->lru, &pooled_sessions);
+		pooled_count++;
+		pooled = true;
+	}
+	spin_unlock(&sessions_lock);
+	
+	if (!pooled){
+		kmem_cache_free(session_cache, session);
+	}
+}
+
+static void drain_pool(void){
+	struct blackjack_session *session, *next;
+	
+	list_for_each_entry_safe(session, next, &pooled_sessions, lru){
+		list_del(&session->lru);
+		kmem_cache_free(session_cache, session);
+	}
+	pooled_count = 0;
+}
+
+static struct blackjack_session *get_session(bool create){
+	struct blackjack_session *session, *new_session = NULL;
+	pid_t sid = pid_nr(task_session(current));		//echo and cat run from the same terminal share a session, and so a table
+	
+	spin_lock(&sessions_lock);
+	session = find_session(sid);
+	
+	if (!session && create){
+		spin_unlock(&sessions_lock);
+		
+		new_session = alloc_session();		//allocate outside of the lock, the shrinker takes it from reclaim
+		if (!new_session){
+			return ERR_PTR(-ENOMEM);
+		}
+		init_table(&new_session->table);
+		new_session->table.id = sid;
+		new_session->sid = sid;
+		new_session->users = 0;
+		
+		spin_lock(&sessions_lock);
+		session = find_session(sid);			//another process of the session may have created the table meanwhile
+		if (!session && (session_count < READ_ONCE(max_sessions))){
+			hash_add(sessions, &new_session->hash, sid);
+			list_add_tail(&new_session->lru, &session_lru);
+			session_count++;
+			session = new_session;
+			new_session = NULL;
+		}
+	}
+	
+	if (session){
+		if (session->users++ == 0){
+			busy_sessions++;
+		}
+		session->last_active = jiffies;
+		list_move_tail(&session->lru, &session_lru);
+	}
+	spin_unlock(&sessions_lock);
+	
+	if (new_session){
+		free_session(new_session);
+	}
+	if (!session){
+		return ERR_PTR(create ? -EBUSY : -ENOENT);
+	}
+	return session;
+}
+
+static void put_session(struct blackjack_session *session){
+	spin_lock(&sessions_lock);
+	if (--session->users == 0){
+		busy_sessions--;
+	}
+	session->last_active = jiffies;
+	list_move_tail(&session->lru, &session_lru);
+	spin_unlock(&sessions_lock);
+}
+
+static bool keeps_recording(const struct blackjack_session *session){	//called with sessions_lock held on an idle session, nothing changes its table
+	const struct blackjack_recording *rec = &session->table.rec;
+	
+	return rec->active || (rec->records && !rec->saved);
+}
+
+static unsigned long collect_idle_sessions(struct list_head *victims, unsigned long idle, unsigned long max){	//called with sessions_lock held
+	struct blackjack_session *session, *next;
+	unsigned long count = 0;
+	
+	list_for_each_entry_safe(session, next, &session_lru, lru){		//least recently used first, stop at the first session that is not idle long enough
+		if (count >= max){
+			break;
+		}
+		if (time_before(jiffies, session->last_active + idle)){
+			break;
+		}
+		if ((session->users > 0) || keeps_recording(session)){	//a recording is only freed once it has been fetched
+			continue;
+		}
+		if (victims){
+			hash_del(&session->hash);
+			list_move_tail(&session->lru, victims);
+			session_count--;
+		}
+		count++;
+	}
+	
+	return count;
+}
+
+static void free_sessions(struct list_head *victims){		//kvfree may sleep, so victims are freed after dropping sessions_lock
+	struct blackjack_session *session, *next;
+	
+	list_for_each_entry_safe(session, next, victims, lru){
+		list_del(&session->lru);
+		free_session(session);
+	}
+}
+
+static unsigned long idle_jiffies(unsigned int secs){		//seconds to jiffies without wrapping for large timeouts
+	return min_t(unsigned long, secs, MAX_JIFFY_OFFSET / HZ) * HZ;
+}
+
+static unsigned long reap_interval(unsigned int timeout){
+	return max_t(unsigned long, HZ, idle_jiffies(timeout) / 4);
+}
+
+static void reap_sessions(struct work_struct *work){
+	unsigned int timeout = READ_ONCE(session_timeout_secs);
+	unsigned long reaped;
+	LIST_HEAD(victims);
+	
+	if (timeout == 0){		//sessions are kept until unload, setting a timeout queues the reaper again
+		return;
+	}
+	
+	spin_lock(&sessions_lock);
+	reaped = collect_idle_sessions(&victims, idle_jiffies(timeout), ULONG_MAX);
+	spin_unlock(&sessions_lock);
+	free_sessions(&victims);
+	
+	if (reaped > 0){
+		printk(KERN_INFO "Blackjack freed %lu idle sessions\n", reaped);
+	}
+	
+	schedule_delayed_work(&reap_work, reap_interval(timeout));
+}
+
+static int session_timeout_set(const char *val, const struct kernel_param *kp){	//called with the module's parameter lock held
+	int ret = param_set_uint(val, kp);
+	
+	if ((ret == 0) && sessions_started){
+		mod_delayed_work(system_wq, &reap_work, 0);	//apply the new timeout now, the reaper picks its next interval from it
+	}
+	return ret;
+}
+
+static unsigned long session_shrink_count(struct shrinker *shrinker, struct shrink_control *sc){
+	//Estimate only: every session without a command in flight, including those kept for a recording. Walking the lru here would hold sessions_lock
+	//across all sessions on every reclaim pass, scan_objects walks just the parked ones it frees.
+	unsigned int count = READ_ONCE(session_count);
+	unsigned int busy = READ_ONCE(busy_sessions);
+	
+	return (count > busy) ? count - busy : 0;	//the two reads are not atomic together
+}
+
+static unsigned long session_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc){
+	unsigned long freed;
+	LIST_HEAD(victims);
+	
+	spin_lock(&sessions_lock);
+	freed = collect_idle_sessions(&victims, idle_jiffies(READ_ONCE(session_park_secs)), sc->nr_to_scan);
+	spin_unlock(&sessions_lock);
+	free_sessions(&victims);
+	
+	return freed ? freed : SHRINK_STOP;
+}
+
+static int start_sessions(void){
+	struct blackjack_session *session;
+	int ret;
+	
+	session_cache = kmem_cache_create("blackjack_session", sizeof(struct blackjack_session), 0, 0, NULL);
+	if (!session_cache){
+		return -ENOMEM;
+	}
+	
+	while (pooled_count < pool_size()){		//nothing else runs yet, the pool is filled without sessions_lock
+		session = kmem_cache_alloc(session_cache, GFP_KERNEL);
+		if (!session){
+			drain_pool();
+			kmem_cache_destroy(session_cache);
+			return -ENOMEM;
+		}
+		list_add(&session->lru, &pooled_sessions);
+		pooled_count++;
+	}
+	
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	ret = register_shrinker(&session_shrinker, "blackjack-sessions");
+#else
+	ret = register_shrinker(&session_shrinker);
+#endif
+	if (ret < 0){
+		drain_pool();
+		kmem_cache_destroy(session_cache);
+		return ret;
+	}
+	
+	kernel_param_lock(THIS_MODULE);
+	sessions_started = true;
+	if (session_timeout_secs > 0){
+		schedule_delayed_work(&reap_work, reap_interval(session_timeout_secs));
+	}
+	kernel_param_unlock(THIS_MODULE);
+	return 0;
+}
+
+static void stop_sessions(void){
+	struct blackjack_session *session, *next;
+	
+	kernel_param_lock(THIS_MODULE);
+	sessions_started = false;		//a new timeout no longer queues the reaper
+	kernel_param_unlock(THIS_MODULE);
+	cancel_delayed_work_sync(&reap_work);
+	unregister_shrinker(&session_shrinker);
+	
+	list_for_each_entry_safe(session, next, &session_lru, lru){	//the device is gone, no session is in use
+		hash_del(&session->hash);
+		list_del(&session->lru);
+		free_session(session);
+	}
+	session_count = 0;
+	busy_sessions = 0;
+	
+	drain_pool();
+	kmem_cache_destroy(session_cache);
+}
+
 static int __init blackjack_init(void) {
-    int ret = misc_register(&blackjack);
+    int ret, i;
+    
+    for_each_possible_cpu(i){
+        spin_lock_init(&per_cpu_ptr(&event_batches, i)->lock);
+    }
+    
+    ret = genl_register_family(&blackjack_genl);
     if (ret < 0){
         printk(KERN_ERR "Blackjack module failed to load\n");
         return ret;
     }
-    printk(KERN_ALERT "Blackjack module loaded successfully\n");
-    mutex_init(&blackjack_mutex);
     
-    //initialize game values
-    current_game.current_state = 0;
-    current_game.player_score = 0;
-    current_game.dealer_score = 0;
+    ret = start_sessions();
+    if (ret < 0){
+        genl_unregister_family(&blackjack_genl);
+        printk(KERN_ERR "Blackjack module failed to load\n");
+        return ret;
+    }
+    
+    ret = start_bots();
+    if (ret < 0){
+        stop_sessions();
+        genl_unregister_family(&blackjack_genl);
+        printk(KERN_ERR "Blackjack module failed to load\n");
+        return ret;
+    }
+    
+    ret = misc_register(&blackjack);
+    if (ret < 0){
+        stop_bots();
+        stop_sessions();
+        cancel_work_sync(&events_work);
+        genl_unregister_family(&blackjack_genl);
+        printk(KERN_ERR "Blackjack module failed to load\n");
+        return ret;
+    }
+    printk(KERN_ALERT "Blackjack module loaded successfully\n");
     
     return 0;
 } 
 
 static void __exit blackjack_exit(void) {
     misc_deregister(&blackjack);
+    stop_bots();
+    stop_sessions();
+    cancel_work_sync(&events_work);		//no table is left to queue events
+    genl_unregister_family(&blackjack_genl);
     printk(KERN_ALERT "Blackjack module unloaded\n");
 }
 
@@ -0,0 +1,162 @@
+#ifndef BLACKJACK_H
+#define BLACKJACK_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+//User space interface of the blackjack module. Include this header to drive /dev/blackjack through ioctl().
+
+enum bj_command {
+	BJ_CMD_INVALID = 0,
+	BJ_CMD_RESET = 1,
+	BJ_CMD_SHUFFLE = 2,
+	BJ_CMD_DEAL = 3,
+	BJ_CMD_HIT = 4,
+	BJ_CMD_HOLD = 5,
+	BJ_CMD_YES = 6,
+	BJ_CMD_NO = 7,
+};
+
+//Responses written to the table's message buffer. In BJ_FORMAT_TEXT each response is an English sentence. In BJ_FORMAT_COMPACT
+//each response is its code on a line of its own, hands are written as "<code> <card> <card> ... <total>" with cards numbered
+//0 - 51 (Ace to King of Spades, Hearts, Diamonds, then Clubs).
+enum bj_msg {
+	BJ_MSG_INVALID_STATE = 1,
+	BJ_MSG_INVALID_COMMAND = 2,
+	BJ_MSG_INVALID_DEAL = 3,
+	BJ_MSG_MULTIPLE_DEAL = 4,
+	BJ_MSG_INVALID_HIT_OR_HOLD = 5,
+	BJ_MSG_RESET = 6,
+	BJ_MSG_SHUFFLE = 7,
+	BJ_MSG_PLAYERS_HAND = 8,
+	BJ_MSG_DEALERS_HAND = 9,
+	BJ_MSG_EMPTY_DECK = 10,
+	BJ_MSG_CONTINUE_DECK = 11,
+	BJ_MSG_NEW_DECK = 12,
+	BJ_MSG_YES_OR_NO = 13,
+	BJ_MSG_BLACKJACK = 14,
+	BJ_MSG_PLAYER_BUSTS = 15,
+	BJ_MSG_DEALER_BUSTS = 16,
+	BJ_MSG_PLAYER_WINS = 17,
+	BJ_MSG_DEALER_WINS = 18,
+	BJ_MSG_HIT_OR_HOLD = 19,
+	BJ_MSG_END_OF_GAME = 20,
+	BJ_MSG_INITIAL_DEAL = 21,
+	BJ_MSG_PLAYER_DRAWS = 22,
+	BJ_MSG_DEALER_REVEALS = 23,
+	BJ_MSG_DEALER_DRAWS = 24,
+};
+
+#define BJ_FORMAT_TEXT 0
+#define BJ_FORMAT_COMPACT 1
+
+//A recording is a bj_rec_header followed by header.count bj_rec entries, one per command written to the table.
+#define BJ_REC_MAGIC 0x43524a42		//"BJRC"
+#define BJ_REC_VERSION 2
+#define BJ_REC_MAX_RECORDS (1 << 20)	//hard cap on the commands of a recording, record_max is clamped to it
+
+#define BJ_REC_OVERFLOW 0x1		//the recording hit record_max and later commands were dropped
+
+//Game state of the table when the recording was started, so a recording started in the middle of a game replays the same game.
+struct bj_rec_state {
+	__s8 deck[52];			//card numbers in dealing order, -1 for cards already dealt
+	__s8 players_hand[15];		//-1 terminated
+	__s8 dealers_hand[15];		//-1 terminated
+	__u8 state;			//game state, 0 (no deck) to 5 (continuing with the same deck)
+	__u8 pad;
+	__s16 player_score;
+	__s16 dealer_score;
+};
+
+struct bj_rec_header {
+	__u32 magic;
+	__u16 version;
+	__u16 record_size;		//sizeof(struct bj_rec)
+	__u32 count;
+	__u32 flags;			//BJ_REC_* flags
+	__u64 start_ns;			//wall clock time the recording was started
+	struct bj_rec_state initial;	//game state the first command was played on
+};
+
+struct bj_rec {
+	__u32 delta_us;			//time since the previous command, saturates at 2^32 - 1
+	__u8 command;			//enum bj_command
+	__u8 pad[3];
+	__u32 seed;			//shuffle seed, 0 for commands other than SHUFFLE
+};
+
+struct bj_rec_buf {
+	__u64 data;			//user buffer receiving the recording
+	__u32 len;			//size of the buffer
+	__u32 used;			//set to the size of the recording, even if the buffer was too small
+};
+
+#define BJ_REPLAY_LOG 0x1		//print the dealer's responses of the replay to the kernel log
+
+struct bj_replay {
+	__u64 data;			//recording to replay, as returned by BJ_IOC_REC_GET
+	__u32 len;			//size of the recording
+	__u32 flags;			//BJ_REPLAY_* flags
+	__u64 elapsed_ns;		//set to the time the replay took
+	__u32 commands;			//set to the number of commands replayed
+	__u32 hands;			//set to the number of hands finished
+	__u32 state;			//set to the game state after the last command
+	__s32 player_score;
+	__s32 dealer_score;
+	__u32 pad;
+};
+
+//Table events are multicast on the "events" group of the "blackjack" generic netlink family. Each BJ_GENL_CMD_EVENTS message
+//carries a batch of events as an array of struct bj_event in BJ_GENL_ATTR_EVENTS and the number of events dropped since the
+//previous message in BJ_GENL_ATTR_DROPPED.
+#define BJ_GENL_NAME "blackjack"
+#define BJ_GENL_VERSION 1
+#define BJ_GENL_MCGRP "events"
+
+enum {
+	BJ_GENL_CMD_UNSPEC,
+	BJ_GENL_CMD_EVENTS,
+};
+
+enum {
+	BJ_GENL_ATTR_UNSPEC,
+	BJ_GENL_ATTR_EVENTS,		//binary, array of struct bj_event
+	BJ_GENL_ATTR_DROPPED,		//u32
+	__BJ_GENL_ATTR_MAX,
+};
+#define BJ_GENL_ATTR_MAX (__BJ_GENL_ATTR_MAX - 1)
+
+#define BJ_TABLE_BOT 0x80000000	//set in the table number of bot players, session ids never reach it
+
+enum bj_event_type {
+	BJ_EVENT_DEAL = 1,		//initial cards dealt
+	BJ_EVENT_ACTION = 2,		//player HIT or HOLD, detail is the enum bj_command
+	BJ_EVENT_OUTCOME = 3,		//hand finished, detail is the enum bj_outcome
+	BJ_EVENT_RESHUFFLE = 4,		//deck shuffled
+};
+
+enum bj_outcome {
+	BJ_OUTCOME_BLACKJACK = 1,
+	BJ_OUTCOME_PLAYER_BUSTS = 2,
+	BJ_OUTCOME_DEALER_BUSTS = 3,
+	BJ_OUTCOME_PLAYER_WINS = 4,
+	BJ_OUTCOME_DEALER_WINS = 5,
+};
+
+struct bj_event {
+	__u64 timestamp_ns;		//monotonic time of the event
+	__u32 table;			//session id of the player, or BJ_TABLE_BOT | n for bot player n
+	__u8 type;			//enum bj_event_type
+	__u8 detail;
+	__u8 player_score;
+	__u8 dealer_score;
+};
+
+#define BJ_IOC_MAGIC 'B'
+#define BJ_IOC_REC_START _IO(BJ_IOC_MAGIC, 1)				//start a new recording on the table, discarding the previous one
+#define BJ_IOC_REC_STOP _IO(BJ_IOC_MAGIC, 2)				//stop recording, the recording is kept for BJ_IOC_REC_GET
+#define BJ_IOC_REC_GET _IOWR(BJ_IOC_MAGIC, 3, struct bj_rec_buf)	//copy the recording to user space
+#define BJ_IOC_REPLAY _IOWR(BJ_IOC_MAGIC, 4, struct bj_replay)		//re-execute a recording at full speed on a scratch table
+#define BJ_IOC_SET_FORMAT _IO(BJ_IOC_MAGIC, 5)				//switch the session's responses to BJ_FORMAT_TEXT or BJ_FORMAT_COMPACT, passed as the argument
+
+#endif